@@ -13,3 +13,69 @@ SELECT dbms_alert.waitany(10);
 /* cleanup */
 SELECT dbms_alert.removeall();
 
+/* Test: signals of rolled back transaction and subtransaction are discarded */
+SELECT dbms_alert.register('c1');
+BEGIN;
+SELECT dbms_alert.signal('c1','rolled back');
+ROLLBACK;
+SELECT dbms_alert.waitone('c1',0);
+BEGIN;
+SELECT dbms_alert.signal('c1','committed');
+SAVEPOINT s1;
+SELECT dbms_alert.signal('c1','rolled back to savepoint');
+ROLLBACK TO s1;
+COMMIT;
+SELECT dbms_alert.waitone('c1',0);
+SELECT dbms_alert.waitone('c1',0);
+
+/* Test: transaction with signals cannot be prepared */
+BEGIN;
+SELECT dbms_alert.signal('c1','prepared');
+PREPARE TRANSACTION 'dbms_alert_c1';
+SELECT dbms_alert.waitone('c1',0);
+
+/* cleanup */
+SELECT dbms_alert.removeall();
+
+/* Test: waitany_all returns all pending alerts, repeated alert once */
+SELECT dbms_alert.register('c2');
+SELECT dbms_alert.register('c3');
+SELECT dbms_alert.signal('c2','first for c2');
+SELECT dbms_alert.signal('c3','only for c3');
+SELECT dbms_alert.signal('c2','last for c2');
+SELECT * FROM dbms_alert.waitany_all(0);
+SELECT * FROM dbms_alert.waitany_all(0);
+SELECT dbms_alert.signal('c2','c2 again');
+SELECT dbms_alert.signal('c3','c3 again');
+SELECT * FROM dbms_alert.waitany_all(0, 1);
+SELECT * FROM dbms_alert.waitany_all(0, 1);
+SELECT * FROM dbms_alert.waitany_all(0, 0);
+
+/* cleanup */
+SELECT dbms_alert.removeall();
+
+/* Test: registered session listens on NOTIFY channel of alert */
+SET orafce.alert_notify_prefix = 'alert_';
+SELECT dbms_alert.register('c4');
+SELECT dbms_alert.register('c5');
+SELECT pg_listening_channels() ORDER BY 1;
+SELECT dbms_alert.remove('c4');
+SELECT pg_listening_channels() ORDER BY 1;
+SELECT dbms_alert.removeall();
+SELECT pg_listening_channels() ORDER BY 1;
+
+/* Test: committed signal is sent by NOTIFY to listening session */
+SELECT dbms_alert.register('c6');
+\o | sed -e 's/PID [0-9]*/PID N/'
+SELECT dbms_alert.signal('c6','notified');
+\o
+SELECT dbms_alert.waitone('c6',0);
+
+/* Test: alert, that cannot be sent by NOTIFY, is still signaled */
+SELECT dbms_alert.register(repeat('x', 60));
+SELECT dbms_alert.signal(repeat('x', 60),'not notified');
+SELECT dbms_alert.waitone(repeat('x', 60),0);
+SELECT dbms_alert.signal('c6',repeat('y', 8000));
+SELECT (dbms_alert.waitone('c6',0)).status;
+SELECT dbms_alert.removeall();
+RESET orafce.alert_notify_prefix;
@@ -0,0 +1,191 @@
+-- Messages are received in the order in which they were sent,
+-- also from queue with many waiting messages
+DO $$
+BEGIN
+  FOR i IN 1..100 LOOP
+    PERFORM dbms_pipe.pack_message(i);
+    IF dbms_pipe.send_message('queue_test_pipe', 0) <> 0 THEN
+      RAISE EXCEPTION 'cannot send message %', i;
+    END IF;
+  END LOOP;
+END $$;
+SELECT name, items FROM dbms_pipe.db_pipes WHERE name = 'queue_test_pipe';
+DO $$
+BEGIN
+  FOR i IN 1..50 LOOP
+    IF dbms_pipe.receive_message('queue_test_pipe', 0) <> 0 THEN
+      RAISE EXCEPTION 'missing message %', i;
+    END IF;
+    IF dbms_pipe.unpack_message_number() <> i THEN
+      RAISE EXCEPTION 'unexpected order of message %', i;
+    END IF;
+  END LOOP;
+END $$;
+-- append to partially read queue
+SELECT dbms_pipe.pack_message(101);
+SELECT dbms_pipe.send_message('queue_test_pipe', 0);
+SELECT name, items FROM dbms_pipe.db_pipes WHERE name = 'queue_test_pipe';
+DO $$
+BEGIN
+  FOR i IN 51..101 LOOP
+    IF dbms_pipe.receive_message('queue_test_pipe', 0) <> 0 THEN
+      RAISE EXCEPTION 'missing message %', i;
+    END IF;
+    IF dbms_pipe.unpack_message_number() <> i THEN
+      RAISE EXCEPTION 'unexpected order of message %', i;
+    END IF;
+  END LOOP;
+END $$;
+-- implicit pipe is removed with its last message
+SELECT count(*) FROM dbms_pipe.db_pipes WHERE name = 'queue_test_pipe';
+-- emptied queue can be used again
+SELECT dbms_pipe.pack_message('again'::text);
+SELECT dbms_pipe.send_message('queue_test_pipe', 0);
+SELECT dbms_pipe.receive_message('queue_test_pipe', 0);
+SELECT dbms_pipe.unpack_message_text();
+-- batch send and receive
+SELECT dbms_pipe.send_messages('queue_batch_pipe', ARRAY['first', NULL, 'third']);
+SELECT dbms_pipe.send_messages('queue_batch_pipe', ARRAY[1.5, 2]);
+SELECT dbms_pipe.pack_message('text'::text);
+SELECT dbms_pipe.pack_message(10);
+SELECT dbms_pipe.send_message('queue_batch_pipe', 0);
+SELECT * FROM dbms_pipe.receive_messages('queue_batch_pipe', 4, 0);
+SELECT * FROM dbms_pipe.receive_messages('queue_batch_pipe', 10, 0);
+SELECT * FROM dbms_pipe.receive_messages('queue_batch_pipe', 10, 0);
+SELECT count(*) FROM dbms_pipe.db_pipes WHERE name = 'queue_batch_pipe';
+-- messages without fields
+SELECT dbms_pipe.send_message('queue_empty_pipe', 0);
+SELECT dbms_pipe.send_message('queue_empty_pipe', 0);
+SELECT * FROM dbms_pipe.receive_messages('queue_empty_pipe', 10, 0);
+SELECT count(*) FROM dbms_pipe.db_pipes WHERE name = 'queue_empty_pipe';
+-- pack buffer grows with the message
+DO $$
+BEGIN
+  FOR i IN 1..100 LOOP
+    PERFORM dbms_pipe.pack_message(i);
+  END LOOP;
+  PERFORM dbms_pipe.send_message('queue_big_pipe', 0);
+  PERFORM dbms_pipe.receive_message('queue_big_pipe', 0);
+  FOR i IN 1..100 LOOP
+    IF dbms_pipe.unpack_message_number() <> i THEN
+      RAISE EXCEPTION 'unexpected item %', i;
+    END IF;
+  END LOOP;
+END $$;
+SELECT dbms_pipe.next_item_type();
+-- message size is limited by orafce.pipe_max_message_size
+SELECT dbms_pipe.pack_message(repeat('x', 9000));
+SET orafce.pipe_max_message_size = '16kB';
+SELECT dbms_pipe.pack_message(repeat('x', 9000));
+SELECT dbms_pipe.reset_buffer();
+RESET orafce.pipe_max_message_size;
+-- unpacked values stay valid after the message is released
+SELECT dbms_pipe.pack_message('first item'::text);
+SELECT dbms_pipe.pack_message('second item'::text);
+SELECT dbms_pipe.send_message('queue_unpack_pipe', 0);
+SELECT dbms_pipe.receive_message('queue_unpack_pipe', 0);
+SELECT dbms_pipe.unpack_message_text(), dbms_pipe.unpack_message_text();
+-- unpacking doesn't copy values, they stay valid after next receive
+DO $$
+DECLARE
+  copied bigint;
+  received bigint;
+  first_value text;
+BEGIN
+  PERFORM dbms_pipe.pack_message(repeat('x', 4000));
+  PERFORM dbms_pipe.send_message('queue_unpack_pipe', 0);
+  PERFORM dbms_pipe.pack_message('next'::text);
+  PERFORM dbms_pipe.send_message('queue_unpack_pipe', 0);
+  copied := dbms_pipe.__received_bytes_copied();
+  PERFORM dbms_pipe.receive_message('queue_unpack_pipe', 0);
+  received := dbms_pipe.__received_bytes_copied() - copied;
+  copied := dbms_pipe.__received_bytes_copied();
+  first_value := dbms_pipe.unpack_message_text();
+  RAISE NOTICE 'receive copied message: %, unpack copied % bytes',
+    received >= 4000, dbms_pipe.__received_bytes_copied() - copied;
+  PERFORM dbms_pipe.receive_message('queue_unpack_pipe', 0);
+  RAISE NOTICE 'values: %, %', first_value = repeat('x', 4000),
+    dbms_pipe.unpack_message_text();
+END $$;
+-- statistics of pipe
+SELECT dbms_pipe.create_pipe('queue_stats_pipe');
+SELECT dbms_pipe.send_messages('queue_stats_pipe', ARRAY['a', 'b', 'c']);
+SELECT count(*) FROM dbms_pipe.receive_messages('queue_stats_pipe', 10, 0);
+SELECT count(*) FROM dbms_pipe.receive_messages('queue_stats_pipe', 10, 0);
+SELECT name, sent, received, bytes_sent, bytes_received, items, max_items,
+       send_timeouts, receive_timeouts, wait_time >= 0 AS wait_time
+  FROM dbms_pipe.pipe_stats WHERE name = 'queue_stats_pipe';
+SELECT dbms_pipe.remove_pipe('queue_stats_pipe');
+-- receive from any of pipes
+SELECT dbms_pipe.pack_message('for second'::text);
+SELECT dbms_pipe.send_message('queue_any_2', 0);
+SELECT dbms_pipe.receive_any(ARRAY['queue_any_1', 'queue_any_2'], 0);
+SELECT dbms_pipe.unpack_message_text();
+SELECT dbms_pipe.receive_any(ARRAY['queue_any_1', 'queue_any_2'], 0);
+-- fan-out pipe
+SELECT dbms_pipe.create_fanout_pipe('queue_fanout_pipe');
+SELECT dbms_pipe.receive_message('queue_fanout_pipe', 0);
+SELECT dbms_pipe.subscribe('queue_fanout_pipe');
+SELECT dbms_pipe.send_messages('queue_fanout_pipe', ARRAY['news 1', 'news 2']);
+SELECT * FROM dbms_pipe.receive_messages('queue_fanout_pipe', 10, 0);
+SELECT name, items FROM dbms_pipe.db_pipes WHERE name = 'queue_fanout_pipe';
+SELECT dbms_pipe.unsubscribe('queue_fanout_pipe');
+-- message without subscribers is dropped
+SELECT dbms_pipe.send_messages('queue_fanout_pipe', ARRAY['lost']);
+SELECT name, sent, received, items FROM dbms_pipe.pipe_stats WHERE name = 'queue_fanout_pipe';
+SELECT dbms_pipe.subscribe('queue_stats_pipe');
+SELECT dbms_pipe.remove_pipe('queue_fanout_pipe');
+-- spill file
+SELECT dbms_pipe.set_spill_threshold('queue_spill_pipe', 60);
+SELECT dbms_pipe.create_pipe('queue_spill_pipe');
+SELECT dbms_pipe.set_spill_threshold('queue_spill_pipe', 60);
+SELECT dbms_pipe.send_messages('queue_spill_pipe', ARRAY['in memory', 'spilled 1', 'spilled 2']);
+SELECT name, items, size FROM dbms_pipe.db_pipes WHERE name = 'queue_spill_pipe';
+SELECT dbms_pipe.set_spill_threshold('queue_spill_pipe', 0);
+SELECT dbms_pipe.send_messages('queue_spill_pipe', ARRAY['after spilled']);
+SELECT * FROM dbms_pipe.receive_messages('queue_spill_pipe', 10, 0);
+SELECT dbms_pipe.send_messages('queue_spill_pipe', ARRAY['in memory again']);
+SELECT name, items, size FROM dbms_pipe.db_pipes WHERE name = 'queue_spill_pipe';
+SELECT dbms_pipe.remove_pipe('queue_spill_pipe');
+-- large message is compressed
+SET orafce.pipe_max_message_size = '32kB';
+SELECT dbms_pipe.pack_message(repeat('abc', 10000));
+SELECT dbms_pipe.send_message('queue_compress_pipe', 0);
+SELECT items, size < 1024 AS compressed FROM dbms_pipe.db_pipes WHERE name = 'queue_compress_pipe';
+SELECT dbms_pipe.receive_message('queue_compress_pipe', 0);
+SELECT dbms_pipe.unpack_message_text() = repeat('abc', 10000);
+RESET orafce.pipe_max_message_size;
+-- values of any type in binary format
+SELECT dbms_pipe.pack_message_any(ARRAY[1, 2, 3]);
+SELECT dbms_pipe.pack_message_any('a0eebc99-9c0b-4ef8-bb6d-6bb9bd380a11'::uuid);
+SELECT dbms_pipe.pack_message_any(ARRAY['x', NULL, 'z']);
+SELECT dbms_pipe.send_message('queue_any_pipe', 0);
+SELECT dbms_pipe.receive_message('queue_any_pipe', 0);
+SELECT dbms_pipe.unpack_message_any(NULL::int[]);
+SELECT dbms_pipe.unpack_message_any(NULL::int);
+SELECT dbms_pipe.unpack_message_any(NULL::uuid);
+SELECT dbms_pipe.unpack_message_any(NULL::text[]);
+SELECT dbms_pipe.unpack_message_any(NULL::text[]);
+-- typed records
+CREATE TYPE queue_rec AS (a int, b text);
+SELECT dbms_pipe.pack_message(ROW(1, 'first')::queue_rec);
+SELECT dbms_pipe.send_message('queue_rec_pipe', 0);
+SELECT dbms_pipe.pack_message(ROW(2, 'second')::queue_rec);
+SELECT dbms_pipe.send_message('queue_rec_pipe', 0);
+SELECT * FROM dbms_pipe.receive_messages('queue_rec_pipe', 1, 0);
+SELECT dbms_pipe.receive_message('queue_rec_pipe', 0);
+SELECT dbms_pipe.unpack_message_record();
+DROP TYPE queue_rec;
+-- expired messages
+SELECT dbms_pipe.set_pipe_ttl('queue_ttl_pipe', 1);
+SELECT dbms_pipe.create_pipe('queue_ttl_pipe');
+SELECT dbms_pipe.set_pipe_ttl('queue_ttl_pipe', 1);
+SELECT dbms_pipe.send_messages('queue_ttl_pipe', ARRAY['short 1', 'short 2']);
+SELECT dbms_pipe.set_pipe_ttl('queue_ttl_pipe', 0);
+SELECT dbms_pipe.set_message_ttl(3600);
+SELECT dbms_pipe.send_messages('queue_ttl_pipe', ARRAY['long']);
+SELECT dbms_pipe.send_messages('queue_ttl_pipe', ARRAY['forever']);
+SELECT pg_sleep(1.2);
+SELECT * FROM dbms_pipe.receive_messages('queue_ttl_pipe', 10, 0);
+SELECT name, sent, received, expired FROM dbms_pipe.pipe_stats WHERE name = 'queue_ttl_pipe';
+SELECT dbms_pipe.remove_pipe('queue_ttl_pipe');
@@ -11,3 +11,122 @@ create view oracle.user_constraints as
                                       end as r_constraint_name
       from pg_constraint c1, pg_class
      where conrelid = pg_class.oid;
+
+CREATE FUNCTION dbms_pipe.send_messages(text, anyarray, int, int)
+RETURNS int
+AS 'MODULE_PATHNAME','dbms_pipe_send_messages'
+LANGUAGE C VOLATILE;
+COMMENT ON FUNCTION dbms_pipe.send_messages(text, anyarray, int, int) IS 'Send every array element as message to pipe';
+
+CREATE FUNCTION dbms_pipe.send_messages(text, anyarray, int)
+RETURNS int
+AS $$SELECT dbms_pipe.send_messages($1,$2,$3,NULL);$$
+LANGUAGE SQL VOLATILE;
+COMMENT ON FUNCTION dbms_pipe.send_messages(text, anyarray, int) IS 'Send every array element as message to pipe';
+
+CREATE FUNCTION dbms_pipe.send_messages(text, anyarray)
+RETURNS int
+AS $$SELECT dbms_pipe.send_messages($1,$2,NULL,NULL);$$
+LANGUAGE SQL VOLATILE;
+COMMENT ON FUNCTION dbms_pipe.send_messages(text, anyarray) IS 'Send every array element as message to pipe';
+
+CREATE FUNCTION dbms_pipe.receive_messages(text, int, int)
+RETURNS SETOF text[]
+AS 'MODULE_PATHNAME','dbms_pipe_receive_messages'
+LANGUAGE C VOLATILE;
+COMMENT ON FUNCTION dbms_pipe.receive_messages(text, int, int) IS 'Receive messages from pipe, returns fields of every message as text array';
+
+CREATE FUNCTION dbms_pipe.receive_messages(text, int)
+RETURNS SETOF text[]
+AS $$SELECT dbms_pipe.receive_messages($1,$2,NULL::int);$$
+LANGUAGE SQL VOLATILE;
+COMMENT ON FUNCTION dbms_pipe.receive_messages(text, int) IS 'Receive messages from pipe, returns fields of every message as text array';
+
+CREATE FUNCTION dbms_pipe.receive_any(text[], int)
+RETURNS text
+AS 'MODULE_PATHNAME','dbms_pipe_receive_any'
+LANGUAGE C VOLATILE;
+COMMENT ON FUNCTION dbms_pipe.receive_any(text[], int) IS 'Receive message from any of pipes, returns name of pipe';
+
+CREATE FUNCTION dbms_pipe.receive_any(text[])
+RETURNS text
+AS $$SELECT dbms_pipe.receive_any($1,NULL::int);$$
+LANGUAGE SQL VOLATILE;
+COMMENT ON FUNCTION dbms_pipe.receive_any(text[]) IS 'Receive message from any of pipes, returns name of pipe';
+
+CREATE FUNCTION dbms_pipe.create_fanout_pipe(text, int)
+RETURNS void
+AS 'MODULE_PATHNAME','dbms_pipe_create_fanout_pipe'
+LANGUAGE C VOLATILE;
+COMMENT ON FUNCTION dbms_pipe.create_fanout_pipe(text, int) IS 'Create named pipe, which messages are received by all subscribers';
+
+CREATE FUNCTION dbms_pipe.create_fanout_pipe(text)
+RETURNS void
+AS $$SELECT dbms_pipe.create_fanout_pipe($1,NULL::int);$$
+LANGUAGE SQL VOLATILE;
+COMMENT ON FUNCTION dbms_pipe.create_fanout_pipe(text) IS 'Create named pipe, which messages are received by all subscribers';
+
+CREATE FUNCTION dbms_pipe.subscribe(text)
+RETURNS void
+AS 'MODULE_PATHNAME','dbms_pipe_subscribe'
+LANGUAGE C VOLATILE STRICT;
+COMMENT ON FUNCTION dbms_pipe.subscribe(text) IS 'Receive messages of fan-out pipe';
+
+CREATE FUNCTION dbms_pipe.unsubscribe(text)
+RETURNS void
+AS 'MODULE_PATHNAME','dbms_pipe_unsubscribe'
+LANGUAGE C VOLATILE STRICT;
+COMMENT ON FUNCTION dbms_pipe.unsubscribe(text) IS 'Stop receiving messages of fan-out pipe';
+
+CREATE FUNCTION dbms_pipe.set_spill_threshold(text, int)
+RETURNS void
+AS 'MODULE_PATHNAME','dbms_pipe_set_spill_threshold'
+LANGUAGE C VOLATILE;
+COMMENT ON FUNCTION dbms_pipe.set_spill_threshold(text, int) IS 'Store messages over threshold bytes of shared memory to spill file';
+
+CREATE FUNCTION dbms_pipe.pack_message_any(anyelement)
+RETURNS void
+AS 'MODULE_PATHNAME','dbms_pipe_pack_message_any'
+LANGUAGE C VOLATILE STRICT;
+COMMENT ON FUNCTION dbms_pipe.pack_message_any(anyelement) IS 'Add field of any type in binary format to message';
+
+CREATE FUNCTION dbms_pipe.unpack_message_any(anyelement)
+RETURNS anyelement
+AS 'MODULE_PATHNAME','dbms_pipe_unpack_message_any'
+LANGUAGE C VOLATILE;
+COMMENT ON FUNCTION dbms_pipe.unpack_message_any(anyelement) IS 'Get field of type of argument from message';
+
+CREATE FUNCTION dbms_pipe.set_pipe_ttl(text, int)
+RETURNS void
+AS 'MODULE_PATHNAME','dbms_pipe_set_pipe_ttl'
+LANGUAGE C VOLATILE;
+COMMENT ON FUNCTION dbms_pipe.set_pipe_ttl(text, int) IS 'Messages of pipe expire after ttl seconds';
+
+CREATE FUNCTION dbms_pipe.set_message_ttl(int)
+RETURNS void
+AS 'MODULE_PATHNAME','dbms_pipe_set_message_ttl'
+LANGUAGE C VOLATILE;
+COMMENT ON FUNCTION dbms_pipe.set_message_ttl(int) IS 'Next sent message expires after ttl seconds';
+
+CREATE FUNCTION dbms_pipe.__pipe_stats()
+RETURNS SETOF RECORD
+AS 'MODULE_PATHNAME','dbms_pipe_pipe_stats'
+LANGUAGE C VOLATILE STRICT;
+COMMENT ON FUNCTION dbms_pipe.__pipe_stats() IS '';
+
+CREATE VIEW dbms_pipe.pipe_stats
+AS SELECT * FROM dbms_pipe.__pipe_stats() AS (name varchar, sent bigint, received bigint, bytes_sent bigint, bytes_received bigint, items int, max_items int, send_timeouts bigint, receive_timeouts bigint, wait_time double precision, expired bigint);
+
+GRANT SELECT ON dbms_pipe.pipe_stats to PUBLIC;
+
+CREATE FUNCTION dbms_pipe.__received_bytes_copied()
+RETURNS bigint
+AS 'MODULE_PATHNAME','dbms_pipe_received_bytes_copied'
+LANGUAGE C VOLATILE STRICT;
+COMMENT ON FUNCTION dbms_pipe.__received_bytes_copied() IS '';
+
+CREATE FUNCTION dbms_alert.waitany_all(OUT name text, OUT message text, timeout float8, max_count integer DEFAULT NULL)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME','dbms_alert_waitany_all'
+LANGUAGE C VOLATILE;
+COMMENT ON FUNCTION dbms_alert.waitany_all(OUT text, OUT text, float8, integer) IS 'Wait for any signal and return all pending signals';
@@ -27,13 +27,20 @@
 #include "postgres.h"
 #include "executor/spi.h"
 
+#include "access/hash.h"
 #include "access/htup_details.h"
+#include "access/xact.h"
 #include "catalog/pg_type.h"
+#include "commands/async.h"
 #include "commands/trigger.h"
 #include "funcapi.h"
 #include "miscadmin.h"
+#include "nodes/pg_list.h"
 #include "string.h"
+#include "storage/ipc.h"
 #include "storage/lwlock.h"
+#include "utils/builtins.h"
+#include "utils/memutils.h"
 #include "utils/timestamp.h"
 
 #include "orafce.h"
@@ -49,11 +56,12 @@ PG_FUNCTION_INFO_V1(dbms_alert_set_defaults);
 PG_FUNCTION_INFO_V1(dbms_alert_signal);
 PG_FUNCTION_INFO_V1(dbms_alert_waitany);
 PG_FUNCTION_INFO_V1(dbms_alert_waitone);
+PG_FUNCTION_INFO_V1(dbms_alert_waitany_all);
 PG_FUNCTION_INFO_V1(dbms_alert_defered_signal);
 
 extern unsigned int sid;
 float8 sensitivity = 250.0;
-extern LWLockId shmem_lockid;
+extern LWLockId alert_lockid;
 
 #ifndef _GetCurrentTimestamp
 #define _GetCurrentTimestamp()    GetCurrentTimestamp()
@@ -70,18 +78,78 @@ extern LWLockId shmem_lockid;
 #define TDAYS    (1000*24*3600)
 
 /*
- * There are maximum 30 events and 255 collaborating sessions
+ * There are maximum orafce.max_events events and orafce.max_locks
+ * collaborating sessions
  *
  */
 
 alert_event *events;
 alert_lock *locks;
+alert_directory *alert_dir;
 
 alert_lock *session_lock = NULL;
 
+/* nobody signals unregistered session */
+#define SESSION_CV()    (session_lock != NULL ? &session_lock->cv : NULL)
+
+/*
+ * Signals are delivered when the signaling transaction commits. Until
+ * then they are kept in list allocated in TopTransactionContext, every
+ * signal remembers nest level of its subtransaction, so it is discarded
+ * when the subtransaction is rolled back.
+ */
+typedef struct {
+  text *event_name;
+  text *message;
+  int   nest_level;
+} pending_signal;
+
+static List *pending_signals = NIL;
+
 #define NOT_FOUND    -1
 #define NOT_USED     -1
 
+/* alerts are bridged to LISTEN/NOTIFY */
+#define NOTIFY_ALERTS() \
+  ((orafce_alert_notify_prefix != NULL) && \
+  (*orafce_alert_notify_prefix != '\0'))
+
+/*
+ * Channels listened by register are remembered, so remove and removeall
+ * unlisten the same channels, although the prefix was changed meanwhile.
+ * The list is allocated in TopMemoryContext.
+ */
+typedef struct {
+  char *event_name;
+  char *channel;
+} listened_alert;
+
+static List *listened_alerts = NIL;
+
+#define event_bucket(hashval) \
+  (&alert_dir->buckets[(hashval) & (alert_dir->nevent_buckets - 1)])
+#define lock_bucket(sid) \
+  (&alert_dir->buckets[alert_dir->nevent_buckets + \
+  ((sid) & (alert_dir->nlock_buckets - 1))])
+
+/*
+ * All alert structures are protected by one lock, separate from pipes.
+ */
+static bool
+lock_alerts (
+  void
+) {
+  if (!ora_attach_shmem(SHMEMMSGSZ, MAX_PIPES, MAX_EVENTS, MAX_LOCKS)) {
+    return (false);
+  }
+
+  LWLockAcquire(alert_lockid, LW_EXCLUSIVE);
+
+  return (true);
+} /* lock_alerts() */
+
+/* ------------------------------------------------------------------------- */
+
 /*
  * Compare text and cstr
  */
@@ -116,6 +184,26 @@ textcmpm (
 
 /* ------------------------------------------------------------------------- */
 
+/*
+ * Returns lock of session sid
+ */
+static alert_lock *
+lookup_lock (
+  int sid
+) {
+  int i;
+
+  for (i = *lock_bucket(sid); i != NO_ALERT_ENTRY; i = locks[i].hash_next) {
+    if (locks[i].sid == sid) {
+      return (&locks[i]);
+    }
+  }
+
+  return (NULL);
+} /* lookup_lock() */
+
+/* ------------------------------------------------------------------------- */
+
 /*
  * find or create event rec
  *
@@ -125,52 +213,91 @@ find_lock (
   int  sid,
   bool create
 ) {
+  alert_lock *result;
+  int *bucket;
   int i;
-  int first_free = NOT_FOUND;
 
   if (session_lock != NULL) {
     return (session_lock);
   }
 
-  for (i = 0; i < MAX_LOCKS; i++) {
-    if (locks[i].sid == sid) {
-      return (&locks[i]);
-    } else if ((locks[i].sid == NOT_USED) && (first_free == NOT_FOUND)) {
-      first_free = i;
-    }
+  if ((NULL != (result = lookup_lock(sid))) || !create) {
+    return (result);
   }
 
-  if (create) {
-    if (first_free != NOT_FOUND) {
-      locks[first_free].sid = sid;
-      locks[first_free].echo = NULL;
-      session_lock = &locks[first_free];
-      return (&locks[first_free]);
-    } else {
-      ereport(ERROR,
-        (errcode(ERRCODE_ORA_PACKAGES_LOCK_REQUEST_ERROR),
-        errmsg("lock request error"),
-        errdetail("Failed to create session lock."),
-        errhint(
-          "There are too many collaborating sessions. Increase MAX_LOCKS in 'pipe.h'.")));
-    }
+  if (NO_ALERT_ENTRY == (i = alert_dir->free_lock)) {
+    ereport(ERROR,
+      (errcode(ERRCODE_ORA_PACKAGES_LOCK_REQUEST_ERROR),
+      errmsg("lock request error"),
+      errdetail("Failed to create session lock."),
+      errhint(
+        "There are too many collaborating sessions. Increase orafce.max_locks.")));
   }
 
-  return (NULL);
+  alert_dir->free_lock = locks[i].hash_next;
+
+  bucket = lock_bucket(sid);
+  locks[i].sid = sid;
+  locks[i].pending = 0;
+  locks[i].hash_next = *bucket;
+  *bucket = i;
+
+  session_lock = &locks[i];
+
+  return (session_lock);
 } /* find_lock() */
 
 /* ------------------------------------------------------------------------- */
 
+/*
+ * Returns lock of session to free list, session has no messages.
+ */
+static void
+release_session_lock (
+  void
+) {
+  int i = session_lock - locks;
+  int *link = lock_bucket(session_lock->sid);
+
+  Assert(session_lock->pending == 0);
+
+  while (*link != i) {
+    Assert(*link != NO_ALERT_ENTRY);
+    link = &locks[*link].hash_next;
+  }
+  *link = session_lock->hash_next;
+
+  session_lock->sid = NOT_USED;
+  session_lock->hash_next = alert_dir->free_lock;
+  alert_dir->free_lock = i;
+
+  session_lock = NULL;
+} /* release_session_lock() */
+
+/* ------------------------------------------------------------------------- */
+
+static uint32
+event_name_hash (
+  text *event_name
+) {
+  return (DatumGetUInt32(hash_any((unsigned char *) VARDATA(event_name),
+    VARSIZE(event_name) - VARHDRSZ)));
+} /* event_name_hash() */
+
+/* ------------------------------------------------------------------------- */
+
 static alert_event *
 find_event (
   text *event_name,
   bool  create,
   int  *event_id
 ) {
+  uint32 hashval = event_name_hash(event_name);
+  int *bucket = event_bucket(hashval);
   int i;
 
-  for (i = 0; i < MAX_EVENTS; i++) {
-    if ((events[i].event_name != NULL) &&
+  for (i = *bucket; i != NO_ALERT_ENTRY; i = events[i].hash_next) {
+    if ((events[i].hashval == hashval) &&
       (textcmpm(event_name, events[i].event_name) == 0)) {
       if (event_id != NULL) {
         *event_id = i;
@@ -180,20 +307,22 @@ find_event (
   }
 
   if (create) {
-    for (i = 0; i < MAX_EVENTS; i++) {
-      if (events[i].event_name == NULL) {
-        events[i].event_name = ora_scstring(event_name);
-
-        events[i].max_receivers = 0;
-        events[i].receivers = NULL;
-        events[i].messages = NULL;
-        events[i].receivers_number = 0;
+    if (NO_ALERT_ENTRY != (i = alert_dir->free_event)) {
+      events[i].event_name = ora_scstring(event_name);
+      alert_dir->free_event = events[i].hash_next;
+
+      events[i].max_receivers = 0;
+      events[i].receivers = NULL;
+      events[i].messages = NULL;
+      events[i].receivers_number = 0;
+      events[i].hashval = hashval;
+      events[i].hash_next = *bucket;
+      *bucket = i;
 
-        if (event_id != NULL) {
-          *event_id = i;
-        }
-        return (&events[i]);
+      if (event_id != NULL) {
+        *event_id = i;
       }
+      return (&events[i]);
     }
 
     ereport(ERROR,
@@ -201,7 +330,7 @@ find_event (
       errmsg("event registeration error"),
       errdetail("Too many registered events."),
       errhint(
-        "There are too many collaborating sessions. Increase MAX_EVENTS in 'pipe.h'.")));
+        "There are too many collaborating sessions. Increase orafce.max_events.")));
   }
 
   return (NULL);
@@ -236,20 +365,23 @@ register_event (
    * Array receivers is increased for 16 fields
    */
   if (first_free == NOT_FOUND) {
-    if (ev->max_receivers + 16 > MAX_LOCKS) {
+    int new_max_receivers;
+
+    if (ev->max_receivers >= MAX_LOCKS) {
       ereport(ERROR,
         (errcode(ERRCODE_ORA_PACKAGES_LOCK_REQUEST_ERROR),
         errmsg("lock request error"),
         errdetail("Failed to create session lock."),
         errhint(
-          "There are too many collaborating sessions. Increase MAX_LOCKS in 'pipe.h'.")));
+          "There are too many collaborating sessions. Increase orafce.max_locks.")));
     }
 
     /* increase receiver's array */
 
-    new_receivers = (int *) salloc((ev->max_receivers + 16)*sizeof(int));
+    new_max_receivers = Min(ev->max_receivers + 16, MAX_LOCKS);
+    new_receivers = (int *) salloc(new_max_receivers*sizeof(int));
 
-    for (i = 0; i < ev->max_receivers + 16; i++) {
+    for (i = 0; i < new_max_receivers; i++) {
       if (i < ev->max_receivers) {
         new_receivers[i] = ev->receivers[i];
       } else {
@@ -257,14 +389,13 @@ register_event (
       }
     }
 
-    ev->max_receivers += 16;
+    first_free = ev->max_receivers;
+    ev->max_receivers = new_max_receivers;
     if (ev->receivers) {
       ora_sfree(ev->receivers);
     }
 
     ev->receivers = new_receivers;
-
-    first_free = ev->max_receivers - 16;
   }
 
   ev->receivers_number += 1;
@@ -295,44 +426,60 @@ unregister_event (
       }
     }
     if (ev->receivers_number == 0) {
+      int *link = event_bucket(ev->hashval);
+
+      while (*link != event_id) {
+        Assert(*link != NO_ALERT_ENTRY);
+        link = &events[*link].hash_next;
+      }
+      *link = ev->hash_next;
+
       ora_sfree(ev->receivers);
       ora_sfree(ev->event_name);
       ev->receivers = NULL;
       ev->event_name = NULL;
+
+      ev->hash_next = alert_dir->free_event;
+      alert_dir->free_event = event_id;
     }
   }
 } /* unregister_event() */
 
 /* ------------------------------------------------------------------------- */
 
+#define receiver_bit(slot)    ((bits8) (1 << ((slot) % BITS_PER_BYTE)))
+#define is_receiver(msg, slot) \
+  (((msg)->receivers[(slot) / BITS_PER_BYTE] & receiver_bit(slot)) != 0)
+
 /*
- * remove receiver from list of receivers.
- * Message has always minimal one receiver
- * Return true, if exist other receiver
+ * Unlinks message from list of its event and from queue and releases it.
  */
-static bool
-remove_receiver (
-  message_item *msg,
-  int           sid
+static void
+free_message (
+  message_item *msg
 ) {
-  int i;
-  bool find_other = false;
-  bool found = false;
-
-  for (i = 0; i < msg->receivers_number; i++) {
-    if (msg->receivers[i] == sid) {
-      msg->receivers[i] = NOT_USED;
-      found = true;
-    } else if (msg->receivers[i] != NOT_USED) {
-      find_other = true;
-    }
-    if (found && find_other) {
-      break;
-    }
+  if (msg->prev_message != NULL) {
+    msg->prev_message->next_message = msg->next_message;
+  } else {
+    events[msg->message_id].messages = msg->next_message;
+  }
+  if (msg->next_message != NULL) {
+    msg->next_message->prev_message = msg->prev_message;
+  }
+
+  if (msg->queue_prev != NULL) {
+    msg->queue_prev->queue_next = msg->queue_next;
+  } else {
+    alert_dir->first_message = msg->queue_next;
+  }
+  if (msg->queue_next != NULL) {
+    msg->queue_next->queue_prev = msg->queue_prev;
+  } else {
+    alert_dir->last_message = msg->queue_prev;
   }
 
-  return (find_other);
-} /* remove_receiver() */
+  ora_sfree(msg);
+} /* free_message() */
 
 /* ------------------------------------------------------------------------- */
 
@@ -356,7 +503,9 @@ find_and_remove_message_item (
   char **event_name
 ) {
   alert_lock *alck;
-  int _message_id;
+  message_item *msg;
+  message_item *next;
+  int slot;
 
   char *result = NULL;
 
@@ -370,77 +519,135 @@ find_and_remove_message_item (
     *event_name = NULL;
   }
 
-  if ((alck != NULL) && (alck->echo != NULL)) {
-    /* if I have registered and created item */
-    struct _message_echo *echo, *last_echo;
+  if ((alck == NULL) || (alck->pending == 0)) {
+    return (NULL);
+  }
 
-    echo = alck->echo;
-    last_echo = NULL;
+  slot = alck - locks;
 
-    while (echo != NULL) {
-      char *message_text;
-      bool destroy_msg_item = false;
+  /* messages for session are read in order of signals */
+  for (msg = alert_dir->first_message;
+    (msg != NULL) && (alck->pending > 0); msg = next) {
+    int _message_id = msg->message_id;
+    bool found;
 
-      if (filter_message && (echo->message_id != message_id)) {
-        last_echo = echo;
-        echo = echo->next_echo;
-        continue;
-      }
+    next = msg->queue_next;
 
-      message_text = echo->message->message;
-      _message_id = echo->message_id;
-
-      if (!remove_receiver(echo->message, sid)) {
-        destroy_msg_item = true;
-        if (echo->message->prev_message != NULL) {
-          echo->message->prev_message->next_message =
-            echo->message->next_message;
-        } else {
-          events[echo->message_id].messages =
-            echo->message->next_message;
-        }
-        if (echo->message->next_message != NULL) {
-          echo->message->next_message->prev_message =
-            echo->message->prev_message;
-        }
-        ora_sfree(echo->message->receivers);
-        ora_sfree(echo->message);
+    if (!is_receiver(msg, slot) ||
+      (filter_message && (_message_id != message_id))) {
+      continue;
+    }
+
+    msg->receivers[slot / BITS_PER_BYTE] &= ~receiver_bit(slot);
+    msg->refs -= 1;
+    alck->pending -= 1;
+
+    found = !remove_all && ((_message_id == message_id) || all);
+    if (found) {
+      /* I have to do local copy */
+      if (msg->message != NULL) {
+        result = pstrdup(msg->message);
       }
-      if (last_echo == NULL) {
-        alck->echo = echo->next_echo;
-        ora_sfree(echo);
-        echo = alck->echo;
-      } else {
-        last_echo->next_echo = echo->next_echo;
-        ora_sfree(echo);
-        echo = last_echo;
+
+      if (event_name != NULL) {
+        *event_name = pstrdup(events[_message_id].event_name);
       }
-      if (remove_all) {
-        if ((message_text != NULL) && destroy_msg_item) {
-          ora_sfree(message_text);
-        }
+    }
 
-        continue;
-      } else if ((_message_id == message_id) || all) {
-        /* I have to do local copy */
-        if (message_text) {
-          result = pstrdup(message_text);
-          if (destroy_msg_item) {
-            ora_sfree(message_text);
-          }
-        }
+    if (msg->refs == 0) {
+      free_message(msg);
+    }
 
-        if (event_name != NULL) {
-          *event_name = pstrdup(events[_message_id].event_name);
-        }
+    if (found) {
+      break;
+    }
+  }
+
+  return (result);
+} /* find_and_remove_message_item() */
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Alert read by waitany_all
+ */
+typedef struct {
+  int   event_id;
+  char *event_name;
+  char *message;
+} drained_alert;
+
+/*
+ * Reads and removes messages for user sid in one pass of the queue.
+ * Messages of the same alert are collapsed, alert keeps the position of
+ * its first message and the text of the last one, like an Oracle alert
+ * signaled more times before it is waited for. At most max_count alerts
+ * are returned, messages of other alerts are left in the queue. Result
+ * is allocated in current memory context.
+ */
+static List *
+remove_message_items (
+  int sid,
+  int max_count
+) {
+  alert_lock *alck;
+  message_item *msg;
+  message_item *next;
+  List *result = NIL;
+  int slot;
 
+  alck = find_lock(sid, false);
+
+  if ((alck == NULL) || (alck->pending == 0)) {
+    return (NIL);
+  }
+
+  slot = alck - locks;
+
+  for (msg = alert_dir->first_message;
+    (msg != NULL) && (alck->pending > 0); msg = next) {
+    drained_alert *alert = NULL;
+    ListCell *lc;
+
+    next = msg->queue_next;
+
+    if (!is_receiver(msg, slot)) {
+      continue;
+    }
+
+    foreach(lc, result) {
+      if (((drained_alert *) lfirst(lc))->event_id == msg->message_id) {
+        alert = (drained_alert *) lfirst(lc);
         break;
       }
     }
+
+    if (alert == NULL) {
+      if (list_length(result) >= max_count) {
+        continue;
+      }
+
+      alert = palloc(sizeof(drained_alert));
+      alert->event_id = msg->message_id;
+      alert->event_name = pstrdup(events[msg->message_id].event_name);
+      result = lappend(result, alert);
+    } else if (alert->message != NULL) {
+      pfree(alert->message);
+    }
+
+    alert->message = msg->message != NULL ? pstrdup(msg->message) : NULL;
+
+    msg->receivers[slot / BITS_PER_BYTE] &= ~receiver_bit(slot);
+    msg->refs -= 1;
+    alck->pending -= 1;
+
+    if (msg->refs == 0) {
+      free_message(msg);
+    }
   }
 
   return (result);
-} /* find_and_remove_message_item() */
+} /* remove_message_items() */
 
 /* ------------------------------------------------------------------------- */
 
@@ -455,15 +662,16 @@ create_message (
   int event_id;
   alert_event *ev;
   message_item *msg_item = NULL;
-  int i, j, k;
-
-  find_event(event_name, false, &event_id);
+  message_item *last = NULL;
+  Size bitmap_size;
+  Size size;
+  int j;
 
   /* process event only when any recipient exitsts */
   if (NULL != (ev = find_event(event_name, false, &event_id))) {
     if (ev->receivers_number > 0) {
-      msg_item = ev->messages;
-      while (msg_item != NULL) {
+      for (msg_item = ev->messages; msg_item != NULL;
+        msg_item = msg_item->next_message) {
         if ((msg_item->message == NULL) && (message == NULL)) {
           return;
         }
@@ -473,84 +681,250 @@ create_message (
           }
         }
 
-        msg_item = msg_item->next_message;
+        last = msg_item;
       }
 
-      msg_item = salloc(sizeof(message_item));
+      /* message, bitmap of receivers and text are allocated together */
+      bitmap_size = (MAX_LOCKS + BITS_PER_BYTE - 1) / BITS_PER_BYTE;
+      size = offsetof(message_item, receivers) + bitmap_size;
+      if (message != NULL) {
+        size += VARSIZE(message) - VARHDRSZ + 1;
+      }
 
-      msg_item->receivers = salloc(ev->receivers_number*sizeof(int));
-      msg_item->receivers_number = ev->receivers_number;
+      msg_item = salloc(size);
+      memset(msg_item->receivers, 0, bitmap_size);
 
       if (message != NULL) {
-        msg_item->message = ora_scstring(message);
+        msg_item->message = ((char *) msg_item->receivers) + bitmap_size;
+        memcpy(msg_item->message, VARDATA(message),
+          VARSIZE(message) - VARHDRSZ);
+        msg_item->message[VARSIZE(message) - VARHDRSZ] = '\0';
       } else {
         msg_item->message = NULL;
       }
 
       msg_item->message_id = event_id;
-      for (i = j = 0; j < ev->max_receivers; j++) {
-        if (ev->receivers[j] != NOT_USED) {
-          msg_item->receivers[i++] = ev->receivers[j];
-          for (k = 0; k < MAX_LOCKS; k++) {
-            if (locks[k].sid == ev->receivers[j]) {
-              /* create echo */
-
-              message_echo *echo = salloc(sizeof(message_echo));
-              echo->message = msg_item;
-              echo->message_id = event_id;
-              echo->next_echo = NULL;
-
-              if (locks[k].echo == NULL) {
-                locks[k].echo = echo;
-              } else {
-                message_echo *p;
-                p = locks[k].echo;
-
-                while (p->next_echo != NULL) {
-                  p = p->next_echo;
-                }
-
-                p->next_echo = echo;
-              }
-            }
-          }
+      msg_item->refs = 0;
+
+      for (j = 0; j < ev->max_receivers; j++) {
+        alert_lock *lock;
+
+        if ((ev->receivers[j] != NOT_USED) &&
+          (NULL != (lock = lookup_lock(ev->receivers[j])))) {
+          int slot = lock - locks;
+
+          msg_item->receivers[slot / BITS_PER_BYTE] |= receiver_bit(slot);
+          msg_item->refs += 1;
+          lock->pending += 1;
+
+          ora_cv_broadcast(&lock->cv);
         }
       }
 
+      if (msg_item->refs == 0) {
+        ora_sfree(msg_item);
+        return;
+      }
+
       msg_item->next_message = NULL;
-      if (ev->messages == NULL) {
-        msg_item->prev_message = NULL;
+      msg_item->prev_message = last;
+      if (last == NULL) {
         ev->messages = msg_item;
       } else {
-        message_item *p;
-        p = ev->messages;
-        while (p->next_message != NULL) {
-          p = p->next_message;
-        }
+        last->next_message = msg_item;
+      }
 
-        p->next_message = msg_item;
-        msg_item->prev_message = p;
+      msg_item->queue_next = NULL;
+      msg_item->queue_prev = alert_dir->last_message;
+      if (alert_dir->last_message == NULL) {
+        alert_dir->first_message = msg_item;
+      } else {
+        alert_dir->last_message->queue_next = msg_item;
       }
+      alert_dir->last_message = msg_item;
     }
   }
 } /* create_message() */
 
 /* ------------------------------------------------------------------------- */
 
+/*
+ * Unregisters session from all events and releases its lock, caller
+ * holds alert lock.
+ */
+static void
+remove_all_events (
+  void
+) {
+  int i;
+
+  find_and_remove_message_item(-1, sid, true, true, false, NULL, NULL);
+
+  for (i = 0; i < MAX_EVENTS; i++) {
+    if (events[i].event_name != NULL) {
+      unregister_event(i, sid);
+    }
+  }
+
+  if (session_lock != NULL) {
+    release_session_lock();
+  }
+} /* remove_all_events() */
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Session, which ends, doesn't receive anything, so its messages and lock
+ * are released.
+ */
+static void
+remove_session_alerts (
+  int   code,
+  Datum arg
+) {
+  if (session_lock == NULL) {
+    return;
+  }
+
+  /* the session can still hold alert lock at exit after error */
+  LWLockReleaseAll();
+
+  LWLockAcquire(alert_lockid, LW_EXCLUSIVE);
+  remove_all_events();
+  LWLockRelease(alert_lockid);
+} /* remove_session_alerts() */
+
+/* ------------------------------------------------------------------------- */
+
 #define WATCH_PRE(t, et, c)                                                   \
   et = GetNowFloat() + (float8) t; c = 0;                                     \
   do {
 
-#define WATCH_POST(t, et, c)                                                  \
+#define WATCH_POST(t, et, c, e)                                               \
     if (GetNowFloat() >= et) {                                                \
       break;                                                                  \
     }                                                                         \
     if (0 == (cycle++ % 100)) {                                               \
       CHECK_FOR_INTERRUPTS();                                                 \
     }                                                                         \
-    pg_usleep(10000L);                                                        \
+    ora_sleep(e);                                                             \
   } while (0 != t)
 
+/*
+ * Like WATCH_POST, but sleeps until cv is signaled.
+ */
+#define WATCH_WAIT(t, et, c, cv, e)                                           \
+    if (GetNowFloat() >= et) {                                                \
+      break;                                                                  \
+    }                                                                         \
+    ora_cv_sleep(cv, et, e);                                                  \
+  } while (0 != t);                                                           \
+  ora_cv_cancel()
+
+/*
+ * NOTIFY channel of alert. Returns NULL, when the name of channel is too
+ * long, the alert works, but it isn't bridged to LISTEN/NOTIFY.
+ */
+static char *
+notify_channel (
+  const char *event_name
+) {
+  char *channel = psprintf("%s%s", orafce_alert_notify_prefix, event_name);
+
+  if (strlen(channel) >= NAMEDATALEN) {
+    ereport(WARNING,
+      (errcode(ERRCODE_NAME_TOO_LONG),
+      errmsg("alert \"%s\" is not bridged to NOTIFY", event_name),
+      errdetail("Channel name \"%s\" is too long.", channel)));
+    pfree(channel);
+    return (NULL);
+  }
+
+  return (channel);
+} /* notify_channel() */
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * LISTEN on channel of alert, when alerts are bridged to NOTIFY
+ */
+static void
+listen_alert (
+  const char *event_name
+) {
+  MemoryContext oldcontext;
+  listened_alert *alert;
+  ListCell *lc;
+  char *channel;
+
+  if (!NOTIFY_ALERTS()) {
+    return;
+  }
+
+  foreach(lc, listened_alerts) {
+    if (strcmp(((listened_alert *) lfirst(lc))->event_name,
+      event_name) == 0) {
+      return;
+    }
+  }
+
+  oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+
+  if (NULL == (channel = notify_channel(event_name))) {
+    MemoryContextSwitchTo(oldcontext);
+    return;
+  }
+
+  alert = palloc(sizeof(listened_alert));
+  alert->event_name = pstrdup(event_name);
+  alert->channel = channel;
+  listened_alerts = lappend(listened_alerts, alert);
+
+  MemoryContextSwitchTo(oldcontext);
+
+  /* LISTEN is transactional, it starts at commit */
+  Async_Listen(alert->channel);
+} /* listen_alert() */
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * UNLISTEN on channel, which was listened for alert. All channels are
+ * unlistened, when event_name is NULL.
+ */
+static void
+unlisten_alert (
+  const char *event_name
+) {
+  MemoryContext oldcontext;
+  List *kept = NIL;
+  ListCell *lc;
+
+  oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+
+  foreach(lc, listened_alerts) {
+    listened_alert *alert = (listened_alert *) lfirst(lc);
+
+    if ((event_name != NULL) && (strcmp(alert->event_name, event_name) != 0)) {
+      kept = lappend(kept, alert);
+      continue;
+    }
+
+    Async_Unlisten(alert->channel);
+
+    pfree(alert->event_name);
+    pfree(alert->channel);
+    pfree(alert);
+  }
+
+  list_free(listened_alerts);
+  listened_alerts = kept;
+
+  MemoryContextSwitchTo(oldcontext);
+} /* unlisten_alert() */
+
+/* ------------------------------------------------------------------------- */
+
 /*
  *
  *  PROCEDURE DBMS_ALERT.REGISTER (name IN VARCHAR2);
@@ -562,18 +936,28 @@ Datum
 dbms_alert_register (
   PG_FUNCTION_ARGS
 ) {
+  static bool exit_callback_registered = false;
+
   text *name = PG_GETARG_TEXT_P(0);
   int cycle = 0;
   float8 endtime;
   float8 timeout = 2;
 
+  /* lock of session is released, when session ends */
+  if (!exit_callback_registered) {
+    before_shmem_exit(remove_session_alerts, (Datum) 0);
+    exit_callback_registered = true;
+  }
+
   WATCH_PRE(timeout, endtime, cycle);
-  if (ora_lock_shmem(SHMEMMSGSZ, MAX_PIPES, MAX_EVENTS, MAX_LOCKS, false)) {
+  if (lock_alerts()) {
     register_event(name);
-    LWLockRelease(shmem_lockid);
+    LWLockRelease(alert_lockid);
+
+    listen_alert(text_to_cstring(name));
     PG_RETURN_VOID();
   }
-  WATCH_POST(timeout, endtime, cycle);
+  WATCH_POST(timeout, endtime, cycle, ORA_WAIT_SHMEM);
   LOCK_ERROR();
   PG_RETURN_VOID();
 } /* dbms_alert_register() */
@@ -601,17 +985,19 @@ dbms_alert_remove (
   float8 timeout = 2;
 
   WATCH_PRE(timeout, endtime, cycle);
-  if (ora_lock_shmem(SHMEMMSGSZ, MAX_PIPES, MAX_EVENTS, MAX_LOCKS, false)) {
+  if (lock_alerts()) {
     ev = find_event(name, false, &ev_id);
     if (NULL != ev) {
       find_and_remove_message_item(ev_id, sid,
         false, true, true, NULL, NULL);
       unregister_event(ev_id, sid);
     }
-    LWLockRelease(shmem_lockid);
+    LWLockRelease(alert_lockid);
+
+    unlisten_alert(text_to_cstring(name));
     PG_RETURN_VOID();
   }
-  WATCH_POST(timeout, endtime, cycle);
+  WATCH_POST(timeout, endtime, cycle, ORA_WAIT_SHMEM);
   LOCK_ERROR();
   PG_RETURN_VOID();
 } /* dbms_alert_remove() */
@@ -629,24 +1015,19 @@ Datum
 dbms_alert_removeall (
   PG_FUNCTION_ARGS
 ) {
-  int i;
   int cycle = 0;
   float8 endtime;
   float8 timeout = 2;
 
   WATCH_PRE(timeout, endtime, cycle);
-  if (ora_lock_shmem(SHMEMMSGSZ, MAX_PIPES, MAX_EVENTS, MAX_LOCKS, false)) {
-    for (i = 0; i < MAX_EVENTS; i++) {
-      if (events[i].event_name != NULL) {
-        find_and_remove_message_item(i, sid,
-          false, true, true, NULL, NULL);
-        unregister_event(i, sid);
-      }
-    }
-    LWLockRelease(shmem_lockid);
+  if (lock_alerts()) {
+    remove_all_events();
+    LWLockRelease(alert_lockid);
+
+    unlisten_alert(NULL);
     PG_RETURN_VOID();
   }
-  WATCH_POST(timeout, endtime, cycle);
+  WATCH_POST(timeout, endtime, cycle, ORA_WAIT_SHMEM);
   LOCK_ERROR();
   PG_RETURN_VOID();
 } /* dbms_alert_removeall() */
@@ -686,17 +1067,17 @@ dbms_alert_waitany (
   }
 
   WATCH_PRE(timeout, endtime, cycle);
-  if (ora_lock_shmem(SHMEMMSGSZ, MAX_PIPES, MAX_EVENTS, MAX_LOCKS, false)) {
+  if (lock_alerts()) {
     str[1] = find_and_remove_message_item(-1, sid,
         true, false, false, NULL, &str[0]);
     if (str[0]) {
       str[2] = "0";
-      LWLockRelease(shmem_lockid);
+      LWLockRelease(alert_lockid);
       break;
     }
-    LWLockRelease(shmem_lockid);
+    LWLockRelease(alert_lockid);
   }
-  WATCH_POST(timeout, endtime, cycle);
+  WATCH_WAIT(timeout, endtime, cycle, SESSION_CV(), ORA_WAIT_ALERT);
 
   get_call_result_type(fcinfo, NULL, &tupdesc);
   btupdesc = BlessTupleDesc(tupdesc);
@@ -761,20 +1142,20 @@ dbms_alert_waitone (
   name = PG_GETARG_TEXT_P(0);
 
   WATCH_PRE(timeout, endtime, cycle);
-  if (ora_lock_shmem(SHMEMMSGSZ, MAX_PIPES, MAX_EVENTS, MAX_LOCKS, false)) {
+  if (lock_alerts()) {
     if (NULL != find_event(name, false, &message_id)) {
       str[0] = find_and_remove_message_item(message_id, sid,
           false, false, false, NULL, &event_name);
       if (event_name != NULL) {
         str[1] = "0";
         pfree(event_name);
-        LWLockRelease(shmem_lockid);
+        LWLockRelease(alert_lockid);
         break;
       }
     }
-    LWLockRelease(shmem_lockid);
+    LWLockRelease(alert_lockid);
   }
-  WATCH_POST(timeout, endtime, cycle);
+  WATCH_WAIT(timeout, endtime, cycle, SESSION_CV(), ORA_WAIT_ALERT);
 
   get_call_result_type(fcinfo, NULL, &tupdesc);
   btupdesc = BlessTupleDesc(tupdesc);
@@ -791,6 +1172,93 @@ dbms_alert_waitone (
 
 /* ------------------------------------------------------------------------- */
 
+/*
+ *
+ *  FUNCTION DBMS_ALERT.WAITANY_ALL(name OUT text, message OUT text
+ *                                 ,timeout IN float8
+ *                                 ,max_count IN integer DEFAULT NULL)
+ *
+ *  Waits for up to timeout seconds for any alert for which the session is
+ *  registered and returns all pending alerts, at most max_count of them.
+ *  Alert signaled more times returns only its last message. No row is
+ *  returned when timeout seconds elapsed without notification.
+ *
+ */
+Datum
+dbms_alert_waitany_all (
+  PG_FUNCTION_ARGS
+) {
+  FuncCallContext *funcctx;
+  ListCell *lc;
+
+  if (SRF_IS_FIRSTCALL()) {
+    float8 timeout;
+    int max_count;
+    TupleDesc tupdesc;
+    MemoryContext oldcontext;
+    List *alerts = NIL;
+    int cycle = 0;
+    float8 endtime;
+
+    if (PG_ARGISNULL(0)) {
+      timeout = TDAYS;
+    } else {
+      timeout = PG_GETARG_FLOAT8(0);
+    }
+
+    if (PG_ARGISNULL(1)) {
+      max_count = INT_MAX;
+    } else {
+      max_count = PG_GETARG_INT32(1);
+      if (max_count <= 0) {
+        ereport(ERROR,
+          (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+          errmsg("max_count must be greater than zero")));
+      }
+    }
+
+    funcctx = SRF_FIRSTCALL_INIT();
+    oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+    WATCH_PRE(timeout, endtime, cycle);
+    if (lock_alerts()) {
+      alerts = remove_message_items(sid, max_count);
+      LWLockRelease(alert_lockid);
+      if (alerts != NIL) {
+        break;
+      }
+    }
+    WATCH_WAIT(timeout, endtime, cycle, SESSION_CV(), ORA_WAIT_ALERT);
+
+    get_call_result_type(fcinfo, NULL, &tupdesc);
+    funcctx->attinmeta = TupleDescGetAttInMetadata(BlessTupleDesc(tupdesc));
+    funcctx->user_fctx = alerts;
+
+    MemoryContextSwitchTo(oldcontext);
+  }
+
+  funcctx = SRF_PERCALL_SETUP();
+
+  lc = list_head((List *) funcctx->user_fctx);
+  if (lc != NULL) {
+    drained_alert *alert = (drained_alert *) lfirst(lc);
+    char *values[2];
+    HeapTuple tuple;
+
+    funcctx->user_fctx = list_delete_first((List *) funcctx->user_fctx);
+
+    values[0] = alert->event_name;
+    values[1] = alert->message;
+    tuple = BuildTupleFromCStrings(funcctx->attinmeta, values);
+
+    SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+  }
+
+  SRF_RETURN_DONE(funcctx);
+} /* dbms_alert_waitany_all() */
+
+/* ------------------------------------------------------------------------- */
+
 /*
  *
  *  PROCEDURE DBMS_ALERT.SET_DEFAULTS(sensitivity IN NUMBER);
@@ -816,8 +1284,9 @@ dbms_alert_set_defaults (
 /* ------------------------------------------------------------------------- */
 
 /*
- * This code was originally in plpgsql
- *
+ * This code was originally in plpgsql. dbms_alert.signal doesn't use
+ * the temp table ora_alerts anymore, the trigger function is kept for
+ * tables created by older versions.
  */
 
 /*
@@ -910,7 +1379,7 @@ dbms_alert_defered_signal (
   }
 
   WATCH_PRE(timeout, endtime, cycle);
-  if (ora_lock_shmem(SHMEMMSGSZ, MAX_PIPES, MAX_EVENTS, MAX_LOCKS, false)) {
+  if (lock_alerts()) {
     ItemPointer tid;
     Oid argtypes[1] = { TIDOID };
     char nulls[1] = { ' ' };
@@ -918,7 +1387,7 @@ dbms_alert_defered_signal (
     void *plan;
 
     create_message(name, message);
-    LWLockRelease(shmem_lockid);
+    LWLockRelease(alert_lockid);
 
     tid = &rettuple->t_data->t_ctid;
 
@@ -940,7 +1409,7 @@ dbms_alert_defered_signal (
     SPI_finish();
     return (PointerGetDatum(rettuple));
   }
-  WATCH_POST(timeout, endtime, cycle);
+  WATCH_POST(timeout, endtime, cycle, ORA_WAIT_SHMEM);
   LOCK_ERROR();
 
   PG_RETURN_NULL();
@@ -948,6 +1417,118 @@ dbms_alert_defered_signal (
 
 /* ------------------------------------------------------------------------- */
 
+/*
+ * Sends signals of committing transaction to registered sessions.
+ */
+static void
+deliver_pending_signals (
+  void
+) {
+  ListCell *lc;
+  int cycle = 0;
+  float8 endtime;
+  float8 timeout = 2;
+
+  if (pending_signals == NIL) {
+    return;
+  }
+
+  WATCH_PRE(timeout, endtime, cycle);
+  if (lock_alerts()) {
+    foreach(lc, pending_signals) {
+      pending_signal *signal = (pending_signal *) lfirst(lc);
+
+      create_message(signal->event_name, signal->message);
+    }
+    LWLockRelease(alert_lockid);
+
+    pending_signals = NIL;
+    return;
+  }
+  WATCH_POST(timeout, endtime, cycle, ORA_WAIT_SHMEM);
+  LOCK_ERROR();
+} /* deliver_pending_signals() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+alert_xact_callback (
+  XactEvent event,
+  void     *arg
+) {
+  switch (event) {
+    case XACT_EVENT_PRE_COMMIT:
+      deliver_pending_signals();
+      break;
+
+    case XACT_EVENT_PRE_PREPARE:
+      if (pending_signals != NIL) {
+        ereport(ERROR,
+          (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+          errmsg("cannot PREPARE a transaction that has signaled alerts")));
+      }
+      break;
+
+    case XACT_EVENT_COMMIT:
+    case XACT_EVENT_ABORT:
+    case XACT_EVENT_PREPARE:
+      /* the list was allocated in TopTransactionContext */
+      pending_signals = NIL;
+      break;
+
+    default:
+      break;
+  }
+} /* alert_xact_callback() */
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Signals of committed subtransaction belong to its parent, signals of
+ * aborted subtransaction are discarded.
+ */
+static void
+alert_subxact_callback (
+  SubXactEvent     event,
+  SubTransactionId mySubid,
+  SubTransactionId parentSubid,
+  void            *arg
+) {
+  int nest_level = GetCurrentTransactionNestLevel();
+  ListCell *lc;
+
+  if (pending_signals == NIL) {
+    return;
+  }
+
+  if (event == SUBXACT_EVENT_COMMIT_SUB) {
+    foreach(lc, pending_signals) {
+      pending_signal *signal = (pending_signal *) lfirst(lc);
+
+      if (signal->nest_level >= nest_level) {
+        signal->nest_level = nest_level - 1;
+      }
+    }
+  } else if (event == SUBXACT_EVENT_ABORT_SUB) {
+    MemoryContext oldcontext;
+    List *kept = NIL;
+
+    oldcontext = MemoryContextSwitchTo(TopTransactionContext);
+    foreach(lc, pending_signals) {
+      pending_signal *signal = (pending_signal *) lfirst(lc);
+
+      if (signal->nest_level < nest_level) {
+        kept = lappend(kept, signal);
+      }
+    }
+    MemoryContextSwitchTo(oldcontext);
+
+    pending_signals = kept;
+  }
+} /* alert_subxact_callback() */
+
+/* ------------------------------------------------------------------------- */
+
 /*
  *
  *  PROCEDURE DBMS_ALERT.SIGNAL(name IN VARCHAR2,message IN VARCHAR2);
@@ -956,41 +1537,18 @@ dbms_alert_defered_signal (
  *  registered for alert name are notified only when the signaling transaction
  *  commits.)
  *
- */
-
-/*
+ *  The signal is queued in session memory and sent by transaction callback
+ *  before commit, so signaling doesn't write anything to database.
  *
- * CREATE OR REPLACE FUNCTION dbms_alert.signal(_event text, _message text) RETURNS void AS $$
- * BEGIN
- * PERFORM 1 FROM pg_catalog.pg_class c
- *          WHERE pg_catalog.pg_table_is_visible(c.oid)
- *          AND c.relkind='r' AND c.relname = 'ora_alerts';
- * IF NOT FOUND THEN
- *  CREATE TEMP TABLE ora_alerts(event text, message text) WITH OIDS;
- *  REVOKE ALL ON TABLE ora_alerts FROM PUBLIC;
- *  CREATE CONSTRAINT TRIGGER ora_alert_signal AFTER INSERT ON ora_alerts
- *    INITIALLY DEFERRED FOR EACH ROW EXECUTE PROCEDURE dbms_alert._defered_signal();
- * END IF;
- * INSERT INTO ora_alerts(event, message) VALUES(_event, _message);
- * END;
- * $$ LANGUAGE plpgsql VOLATILE SECURITY DEFINER;
  */
-
-#define SPI_EXEC(cmd, _type_)                  \
-  if (SPI_OK_ ## _type_ != SPI_exec(cmd, 1)) { \
-    ereport(ERROR,                             \
-      (errcode(ERRCODE_INTERNAL_ERROR),        \
-      errmsg("SPI execute error"),             \
-      errdetail("Can't execute %s.", cmd))); }
-
 Datum
 dbms_alert_signal (
   PG_FUNCTION_ARGS
 ) {
-  void *plan;
-  Oid argtypes[] = { TEXTOID, TEXTOID };
-  Datum values[2];
-  char nulls[2] = { ' ', ' ' };
+  static bool callbacks_registered = false;
+
+  pending_signal *signal;
+  MemoryContext oldcontext;
 
   if (PG_ARGISNULL(0)) {
     ereport(ERROR,
@@ -999,47 +1557,48 @@ dbms_alert_signal (
       errdetail("Eventname may not be NULL.")));
   }
 
-  if (PG_ARGISNULL(1)) {
-    nulls[1] = 'n';
+  if (!callbacks_registered) {
+    RegisterXactCallback(alert_xact_callback, NULL);
+    RegisterSubXactCallback(alert_subxact_callback, NULL);
+    callbacks_registered = true;
   }
 
-  values[0] = PG_GETARG_DATUM(0);
-  values[1] = PG_GETARG_DATUM(1);
+  oldcontext = MemoryContextSwitchTo(TopTransactionContext);
 
-  if (SPI_connect() < 0) {
-    ereport(ERROR,
-      (errcode(ERRCODE_INTERNAL_ERROR),
-      errmsg("SPI_connect failed")));
-  }
+  signal = (pending_signal *) palloc(sizeof(pending_signal));
+  signal->event_name = DatumGetTextPCopy(PG_GETARG_DATUM(0));
+  signal->message = PG_ARGISNULL(1) ? NULL :
+    DatumGetTextPCopy(PG_GETARG_DATUM(1));
+  signal->nest_level = GetCurrentTransactionNestLevel();
 
-  SPI_EXEC("SELECT 1 FROM pg_catalog.pg_class c "
-    "WHERE pg_catalog.pg_table_is_visible(c.oid) "
-    "AND c.relkind='r' AND c.relname = 'ora_alerts'", SELECT);
-  if (0 == SPI_processed) {
-    SPI_EXEC("CREATE TEMP TABLE ora_alerts(event text, message text)",
-      UTILITY);
-    SPI_EXEC("REVOKE ALL ON TABLE ora_alerts FROM PUBLIC", UTILITY);
-    SPI_EXEC("CREATE CONSTRAINT TRIGGER ora_alert_signal AFTER INSERT ON ora_alerts "
-      "INITIALLY DEFERRED FOR EACH ROW EXECUTE PROCEDURE dbms_alert.defered_signal()",
-      UTILITY);
-  }
+  pending_signals = lappend(pending_signals, signal);
 
-  if (!(plan = SPI_prepare(
-      "INSERT INTO ora_alerts(event,message) VALUES($1, $2)",
-      2,
-      argtypes))) {
-    ereport(ERROR,
-      (errcode(ERRCODE_INTERNAL_ERROR),
-      errmsg("SPI_prepare failed")));
-  }
+  MemoryContextSwitchTo(oldcontext);
 
-  if (SPI_OK_INSERT != SPI_execute_plan(plan, values, nulls, false, 1)) {
-    ereport(ERROR,
-      (errcode(ERRCODE_INTERNAL_ERROR),
-      errmsg("can't execute sql")));
+  /*
+   * NOTIFY is sent at commit and discarded by rollback like the signal,
+   * and it also collapses duplicate notifications of transaction. Alert,
+   * that cannot be sent by NOTIFY, is still signaled.
+   */
+  if (NOTIFY_ALERTS()) {
+    char *channel = notify_channel(text_to_cstring(signal->event_name));
+    char *payload = signal->message != NULL ?
+      text_to_cstring(signal->message) : "";
+
+    if (channel == NULL) {
+      /* too long name of channel was reported */
+    } else if (strlen(payload) >= NOTIFY_PAYLOAD_MAX_LENGTH) {
+      ereport(WARNING,
+        (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+        errmsg("alert \"%s\" is not bridged to NOTIFY",
+          text_to_cstring(signal->event_name)),
+        errdetail("Message must be shorter than %d bytes.",
+          NOTIFY_PAYLOAD_MAX_LENGTH)));
+    } else {
+      Async_Notify(channel, payload);
+    }
   }
 
-  SPI_finish();
   PG_RETURN_VOID();
 } /* dbms_alert_signal() */
 
@@ -27,18 +27,37 @@
 #include "postgres.h"
 #include "funcapi.h"
 #include "fmgr.h"
+#include "access/hash.h"
 #include "access/htup_details.h"
 #include "storage/shmem.h"
 #include "utils/memutils.h"
 #include "utils/timestamp.h"
 #include "storage/lwlock.h"
+#include "storage/fd.h"
+#include "storage/ipc.h"
 #include "miscadmin.h"
+#include "pgstat.h"
 #include "string.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "lib/stringinfo.h"
 #include "catalog/pg_type.h"
+#if PG_VERSION_NUM >= 90500
+#include "common/pg_lzcompress.h"
+#endif
+#if PG_VERSION_NUM >= 140000 && defined(USE_LZ4)
+#include <lz4.h>
+#define ORA_USE_LZ4
+#endif
+#include "utils/array.h"
 #include "utils/builtins.h"
 #include "utils/date.h"
+#include "utils/hsearch.h"
+#include "utils/inval.h"
+#include "utils/lsyscache.h"
 #include "utils/numeric.h"
+#include "utils/syscache.h"
 
 #include "shmmc.h"
 #include "pipe.h"
@@ -91,6 +110,19 @@ PG_FUNCTION_INFO_V1(dbms_pipe_pack_message_record);
 PG_FUNCTION_INFO_V1(dbms_pipe_unpack_message_record);
 PG_FUNCTION_INFO_V1(dbms_pipe_pack_message_integer);
 PG_FUNCTION_INFO_V1(dbms_pipe_pack_message_bigint);
+PG_FUNCTION_INFO_V1(dbms_pipe_send_messages);
+PG_FUNCTION_INFO_V1(dbms_pipe_receive_messages);
+PG_FUNCTION_INFO_V1(dbms_pipe_pipe_stats);
+PG_FUNCTION_INFO_V1(dbms_pipe_receive_any);
+PG_FUNCTION_INFO_V1(dbms_pipe_create_fanout_pipe);
+PG_FUNCTION_INFO_V1(dbms_pipe_subscribe);
+PG_FUNCTION_INFO_V1(dbms_pipe_unsubscribe);
+PG_FUNCTION_INFO_V1(dbms_pipe_set_spill_threshold);
+PG_FUNCTION_INFO_V1(dbms_pipe_pack_message_any);
+PG_FUNCTION_INFO_V1(dbms_pipe_unpack_message_any);
+PG_FUNCTION_INFO_V1(dbms_pipe_set_pipe_ttl);
+PG_FUNCTION_INFO_V1(dbms_pipe_set_message_ttl);
+PG_FUNCTION_INFO_V1(dbms_pipe_received_bytes_copied);
 
 typedef enum {
   IT_NO_MORE_ITEMS = 0,
@@ -99,36 +131,133 @@ typedef enum {
   IT_DATE          = 12,
   IT_TIMESTAMPTZ   = 13,
   IT_BYTEA         = 23,
-  IT_RECORD        = 24
+  IT_RECORD        = 24,
+  IT_BINARY        = 25   /* any type in binary format, tupType is its type */
 } message_data_type;
 
 typedef struct _queue_item {
   void               *ptr;
   struct _queue_item *next_item;
+  int                 refs;        /* subscribers, who haven't read it */
+  TimestampTz         expires;     /* 0 is never */
 } queue_item;
 
+/*
+ * Session subscribed to fan-out pipe. Cursor is its first unread item,
+ * NULL when the session has read all items.
+ */
+typedef struct {
+  unsigned int        sid;
+  struct _queue_item *cursor;
+} subscriber;
+
+/*
+ * Counters of pipe, they are updated under pipe lock and shown by
+ * dbms_pipe.pipe_stats.
+ */
+typedef struct {
+  int64 sent;
+  int64 received;
+  int64 bytes_sent;
+  int64 bytes_received;
+  int   max_count;          /* high-water mark of queue depth */
+  int64 send_timeouts;
+  int64 receive_timeouts;
+  int64 wait_time;          /* in microseconds */
+  int64 expired;            /* messages removed after their time to live */
+} pipe_stats;
+
+/*
+ * Queue of pipe is protected by its own lock. Pipe directory lock is
+ * held in shared mode together with pipe lock, and exclusively when pipes
+ * are registered or removed.
+ */
 typedef struct {
+#if PG_VERSION_NUM >= 90600
+  LWLock              lock;
+#else
+  LWLockId            lockid;
+#endif
   bool                is_valid;
   bool                registered;
   char               *pipe_name;
   char               *creator;
   Oid                 uid;
   struct _queue_item *items;
-  int16               count;
-  int16               limit;
+  struct _queue_item *last_item;   /* tail of items, O(1) append */
+  int                 count;
+  int                 limit;
   int                 size;
+  uint32              hashval;
+  int                 hash_next;   /* next pipe in bucket or in free list */
+  pipe_stats          stats;
+  bool                fanout;      /* every message is read by all subscribers */
+  subscriber         *subscribers;
+  int                 nsubscribers;
+  int                 max_subscribers;
+  int                 spill_threshold; /* bytes in memory, 0 is no spill */
+  int                 spill_count;     /* messages in spill file */
+  off_t               spill_read_off;
+  off_t               spill_ready_off; /* end of written messages */
+  off_t               spill_write_off; /* end of reserved messages */
+  bool                spill_writing;   /* reserved messages are written */
+  bool                spill_reading;   /* reserved messages are read */
+  uint32              spill_gen;       /* incremented when file is removed */
+  int                 ttl;             /* seconds, 0 is no expiry */
+  int                 expiring;        /* items in memory with expiry */
+  uint32              data_version;    /* incremented by every send */
 } pipe;
 
+#if PG_VERSION_NUM >= 90600
+#define pipe_lockid(p)    (&(p)->lock)
+#else
+#define pipe_lockid(p)    ((p)->lockid)
+#endif
+
+#define NO_PIPE    -1
+
+/*
+ * Pipes are indexed by hash of name. Buckets and hash_next links are
+ * indexes to array of pipes, unused pipes are linked in free list.
+ * Receivers wait on condition variable of bucket, senders waiting for
+ * free space on space_cv (ora_sfree broadcasts it too, so memory released
+ * by dbms_alert wakes them), receive_any waits on data_cv signaled with
+ * every sent message. Woken receive_any checks data_version of its pipes
+ * and pipes_version without locks, before it scans its pipes again.
+ */
+typedef struct {
+  int    first_pipe;
+  ora_cv cv;
+} pipe_bucket;
+
+typedef struct {
+  int         nbuckets;    /* power of 2 */
+  int         free_pipe;
+  uint32      pipes_version;  /* incremented by every new pipe */
+  ora_cv      space_cv;
+  ora_cv      data_cv;
+  pipe_bucket buckets[1];  /* flexible array member */
+} pipe_directory;
+
 typedef struct {
   int32             size;
   message_data_type type;
   Oid               tupType;
+  int32             vl_len;  /* varlena header of unpacked value */
 } message_data_item;
 
+/* compression method of message, lz4 is used when server has it */
+typedef enum {
+  MC_PGLZ = 0,
+  MC_LZ4  = 1
+} message_compression;
+
 typedef struct {
-  int32              size;
-  int32              items_count;
-  message_data_item *next;
+  int32               size;
+  int32               items_count;
+  int32               raw_size;     /* size before compression, 0 if raw */
+  message_compression compression;  /* method, when raw_size > 0 */
+  message_data_item  *next;
 } message_buffer;
 
 #define message_buffer_size       (MAXALIGN(sizeof(message_buffer)))
@@ -143,21 +272,46 @@ typedef struct {
 #define message_data_item_next(msg) \
   ((message_data_item *) (message_data_get_content(msg) + MAXALIGN(msg->size)))
 
+/*
+ * Rows are built under directory lock in first call, so the lock isn't
+ * held between calls of SRF, when caller doesn't read all rows.
+ */
 typedef struct PipesFctx {
-  int pipe_nth;
+  HeapTuple *tuples;
+  int        ntuples;
+  int        tuple_nth;
 } PipesFctx;
 
+typedef struct MessagesFctx {
+  message_buffer **messages;
+  int              count;
+  int              nth;
+} MessagesFctx;
+
+/*
+ * Every lock has its own tranche, so the waiting for them is visible
+ * in pg_stat_activity.
+ */
 typedef struct {
 #if PG_VERSION_NUM >= 90600
-  int          tranche_id;
+  int          directory_tranche_id;
+  int          pipe_tranche_id;
+  int          alert_tranche_id;
+  int          shmem_tranche_id;
+  LWLock       directory_lock;
+  LWLock       alert_lock;
   LWLock       shmem_lock;
 #else
+  LWLockId     directory_lockid;
+  LWLockId     alert_lockid;
   LWLockId     shmem_lockid;
 #endif
 
   pipe        *pipes;
+  pipe_directory *directory;
   alert_event *events;
   alert_lock  *locks;
+  alert_directory *alert_dir;
   size_t       size;
   unsigned int sid;
   vardata      data[1]; /* flexible array member */
@@ -165,19 +319,69 @@ typedef struct {
 
 #define sh_memory_size    (offsetof(sh_memory, data))
 
+/*
+ * Arrays of pipes, events and locks and their directories are placed
+ * behind sh_memory header, the rest of segment is managed by shmmc.
+ */
+#define pipes_size(n)     (MAXALIGN(mul_size((n), sizeof(pipe))))
+#define directory_size(n) \
+  (MAXALIGN(add_size(offsetof(pipe_directory, buckets), \
+  mul_size(pipe_buckets(n), sizeof(pipe_bucket)))))
+#define events_size(n)    (MAXALIGN(mul_size((n), sizeof(alert_event))))
+#define locks_size(n)     (MAXALIGN(mul_size((n), sizeof(alert_lock))))
+#define alert_directory_size(e, l) \
+  (MAXALIGN(add_size(offsetof(alert_directory, buckets), \
+  mul_size(add_size(pipe_buckets(e), pipe_buckets(l)), sizeof(int)))))
+
 message_buffer *output_buffer = NULL;
+static int32 output_buffer_capacity = 0;
 message_buffer *input_buffer = NULL;
 
+/* time to live of messages sent next by session, 0 uses ttl of pipe */
+static int output_ttl = 0;
+
+/*
+ * Received message lives in its own memory context. Unpacked text, bytea
+ * and numeric values point into the message. Every memory context, which
+ * got such value, holds a reference of the message, and its reset callback
+ * releases it. The message, which is not needed, is reset for reuse, when
+ * nobody references it, else its context is detached and deleted with the
+ * last reference.
+ */
+typedef struct {
+  MemoryContext context;     /* context of message */
+  MemoryContext last_owner;  /* context, which got last value */
+  int           refs;
+  bool          released;
+} input_message_refs;
+
+#if PG_VERSION_NUM >= 90500
+typedef struct {
+  MemoryContextCallback callback;
+  input_message_refs   *refs;
+  MemoryContext         owner;
+} input_message_ref;
+#endif
+
+static MemoryContext input_context = NULL;
+static input_message_refs *input_refs = NULL;
+
+/* bytes copied to local memory by receiving of messages */
+static int64 input_bytes_copied = 0;
+
 pipe *pipes = NULL;
+static pipe_directory *directory = NULL;
 
 #define NOT_INITIALIZED    NULL
 
-LWLockId shmem_lockid = NOT_INITIALIZED;
+static LWLockId directory_lockid = NOT_INITIALIZED;
+LWLockId alert_lockid = NOT_INITIALIZED;
 
 unsigned int sid;                                 /* session id */
 
 extern alert_event *events;
 extern alert_lock *locks;
+extern alert_directory *alert_dir;
 
 /*
  * write on writer size bytes from ptr
@@ -194,13 +398,6 @@ pack_field (
   message_data_item *message;
 
   len = MAXALIGN(size) + message_data_item_size;
-  if (MAXALIGN(buffer->size) + len > LOCALMSGSZ - message_buffer_size) {
-    ereport(ERROR,
-      (errcode(ERRCODE_OUT_OF_MEMORY),
-      errmsg("out of memory"),
-      errdetail("Packed message is bigger than local buffer."),
-      errhint("Increase LOCALMSGSZ in 'pipe.h' and recompile library.")));
-  }
 
   if (buffer->next == NULL) {
     buffer->next = message_buffer_get_content(buffer);
@@ -208,13 +405,18 @@ pack_field (
 
   message = buffer->next;
 
+  /*
+   * The buffer is not zeroed when it grows, so the header and padding
+   * bytes are cleared here.
+   */
+  memset(message, 0, message_data_item_size);
   message->size = size;
   message->type = type;
   message->tupType = tupType;
 
-  /* padding bytes have to be zeroed - buffer creator is responsible to clear memory */
-
   memcpy(message_data_get_content(message), ptr, size);
+  memset((char *) message_data_get_content(message) + size, 0,
+    MAXALIGN(size) - size);
 
   buffer->size += len;
   buffer->items_count++;
@@ -252,114 +454,441 @@ unpack_field (
 /* ------------------------------------------------------------------------- */
 
 /*
- * Add ptr to queue. If pipe doesn't exist, register new pipe
+ * Number of hash buckets for max_pipes pipes (used for events and locks
+ * too) - the smallest power of 2 not less than max_pipes.
  */
-bool
-ora_lock_shmem (
+static int
+pipe_buckets (
+  int max_pipes
+) {
+  int result = 1;
+
+  while (result < max_pipes) {
+    result <<= 1;
+  }
+
+  return (result);
+} /* pipe_buckets() */
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Returns size of shared memory segment for message heap of size bytes
+ * and given limits.
+ */
+Size
+ora_shmem_size (
   size_t size,
   int    max_pipes,
   int    max_events,
-  int    max_locks,
-  bool   reset
+  int    max_locks
 ) {
-  int i;
-  bool found;
+  Size result = MAXALIGN(sh_memory_size);
 
-  sh_memory *sh_mem;
+  result = add_size(result, pipes_size(max_pipes));
+  result = add_size(result, directory_size(max_pipes));
+  result = add_size(result, events_size(max_events));
+  result = add_size(result, locks_size(max_locks));
+  result = add_size(result, alert_directory_size(max_events, max_locks));
+  result = add_size(result, MAXALIGN(size));
 
-  if (pipes == NULL) {
-    sh_mem = ShmemInitStruct("dbms_pipe", size, &found);
-    if (sh_mem == NULL) {
-      ereport(FATAL,
-        (errcode(ERRCODE_OUT_OF_MEMORY),
-        errmsg("out of memory"),
-        errdetail("Failed while allocation block %lu bytes in shared memory.",
-        (unsigned long) size)));
-    }
+  return (result);
+} /* ora_shmem_size() */
 
-    if (!found) {
-#if PG_VERSION_NUM >= 90600
-      sh_mem->tranche_id = LWLockNewTrancheId();
-      LWLockInitialize(&sh_mem->shmem_lock, sh_mem->tranche_id);
+/* ------------------------------------------------------------------------- */
 
-      {
-#if PG_VERSION_NUM >= 100000
-        LWLockRegisterTranche(sh_mem->tranche_id, "orafce");
-#else
-        static LWLockTranche tranche;
+/*
+ * Waiting for changes of shared objects. With condition variables
+ * the waiter sleeps until some other session broadcasts the change,
+ * else it polls every 10 ms. Waiter has to check its condition after
+ * every wakeup and call ora_cv_cancel() when it stops waiting.
+ */
+void
+ora_cv_init (
+  ora_cv *cv
+) {
+#ifdef ORA_WAIT_CV
+  ConditionVariableInit(cv);
+#endif
+} /* ora_cv_init() */
+
+/* ------------------------------------------------------------------------- */
 
-        tranche.name = "orafce";
-        tranche.array_base = &sh_mem->shmem_lock;
-        tranche.array_stride = sizeof(LWLock);
-        LWLockRegisterTranche(sh_mem->tranche_id, &tranche);
+void
+ora_cv_broadcast (
+  ora_cv *cv
+) {
+#ifdef ORA_WAIT_CV
+  ConditionVariableBroadcast(cv);
 #endif
+} /* ora_cv_broadcast() */
 
-        shmem_lockid = &sh_mem->shmem_lock;
-      }
+/* ------------------------------------------------------------------------- */
+
+#ifdef ORA_WAIT_EVENTS
+static uint32
+wait_event_info (
+  ora_wait_event event
+) {
+#if PG_VERSION_NUM >= 170000
+  static const char *names[ORA_WAIT_EVENTS_COUNT] = {
+    "OrafcePipeReceive",
+    "OrafcePipeSend",
+    "OrafceAlertWait",
+    "OrafceSharedMemory"
+  };
+  static uint32 infos[ORA_WAIT_EVENTS_COUNT];
+
+  if (infos[event] == 0) {
+    infos[event] = WaitEventExtensionNew(names[event]);
+  }
+
+  return (infos[event]);
 #else
-      shmem_lockid = sh_mem->shmem_lockid = LWLockAssign();
+  return (PG_WAIT_EXTENSION);
+#endif
+} /* wait_event_info() */
 #endif
 
-      LWLockAcquire(shmem_lockid, LW_EXCLUSIVE);
+/* ------------------------------------------------------------------------- */
 
-      sh_mem->size = size - sh_memory_size;
-      ora_sinit(sh_mem->data, size, true);
-      pipes = sh_mem->pipes = ora_salloc(max_pipes*sizeof(pipe));
-      sid = sh_mem->sid = 1;
-      for (i = 0; i < max_pipes; i++) {
-        pipes[i].is_valid = false;
-      }
+/*
+ * Sleep a while, used by waiters polling shared memory.
+ */
+void
+ora_sleep (
+  ora_wait_event event
+) {
+#ifdef ORA_WAIT_EVENTS
+  pgstat_report_wait_start(wait_event_info(event));
+#endif
+  pg_usleep(10000L);
+#ifdef ORA_WAIT_EVENTS
+  pgstat_report_wait_end();
+#endif
+} /* ora_sleep() */
 
-      events = sh_mem->events = ora_salloc(max_events*sizeof(alert_event));
-      locks = sh_mem->locks = ora_salloc(max_locks*sizeof(alert_lock));
+/* ------------------------------------------------------------------------- */
 
-      for (i = 0; i < max_events; i++) {
-        events[i].event_name = NULL;
-        events[i].max_receivers = 0;
-        events[i].receivers = NULL;
-        events[i].messages = NULL;
-      }
-      for (i = 0; i < max_locks; i++) {
-        locks[i].sid = -1;
-        locks[i].echo = NULL;
-      }
-    } else if (pipes == NULL) {
-#if PG_VERSION_NUM >= 90600
+/*
+ * Sleep on cv, at most to endtime. When cv is NULL, there is nobody
+ * to wake us, and we only wait a while.
+ */
+void
+ora_cv_sleep (
+  ora_cv        *cv,
+  float8         endtime,
+  ora_wait_event event
+) {
+#ifdef ORA_WAIT_CV
+  if (cv != NULL) {
+    float8 remaining = (endtime - GetNowFloat()) * 1000.0;
+    long timeout;
+
+    /* long sleeps are cut, so long timeouts cannot overflow */
+    if (remaining > 60000.0) {
+      timeout = 60000L;
+    } else if (remaining < 1.0) {
+      timeout = 1L;
+    } else {
+      timeout = (long) remaining;
+    }
+
+    (void) ConditionVariableTimedSleep(cv, timeout, wait_event_info(event));
+    return;
+  }
+#endif
+
+  CHECK_FOR_INTERRUPTS();
+  ora_sleep(event);
+} /* ora_cv_sleep() */
+
+/* ------------------------------------------------------------------------- */
+
+void
+ora_cv_cancel (
+  void
+) {
+#ifdef ORA_WAIT_CV
+  ConditionVariableCancelSleep();
+#endif
+} /* ora_cv_cancel() */
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Tranches have to be registered in every backend, else their names
+ * are not known.
+ */
+static void
+register_tranches (
+  sh_memory *sh_mem
+) {
 #if PG_VERSION_NUM >= 100000
-      LWLockRegisterTranche(sh_mem->tranche_id, "orafce");
-#else
-      static LWLockTranche tranche;
+  LWLockRegisterTranche(sh_mem->directory_tranche_id, "orafce_pipe_directory");
+  LWLockRegisterTranche(sh_mem->pipe_tranche_id, "orafce_pipe");
+  LWLockRegisterTranche(sh_mem->alert_tranche_id, "orafce_alert");
+  LWLockRegisterTranche(sh_mem->shmem_tranche_id, "orafce_shmem");
+#elif PG_VERSION_NUM >= 90600
+  static LWLockTranche directory_tranche;
+  static LWLockTranche pipe_tranche;
+  static LWLockTranche alert_tranche;
+  static LWLockTranche shmem_tranche;
+
+  directory_tranche.name = "orafce_pipe_directory";
+  directory_tranche.array_base = &sh_mem->directory_lock;
+  directory_tranche.array_stride = sizeof(LWLock);
+  LWLockRegisterTranche(sh_mem->directory_tranche_id, &directory_tranche);
+
+  pipe_tranche.name = "orafce_pipe";
+  pipe_tranche.array_base = &sh_mem->pipes[0].lock;
+  pipe_tranche.array_stride = sizeof(pipe);
+  LWLockRegisterTranche(sh_mem->pipe_tranche_id, &pipe_tranche);
+
+  alert_tranche.name = "orafce_alert";
+  alert_tranche.array_base = &sh_mem->alert_lock;
+  alert_tranche.array_stride = sizeof(LWLock);
+  LWLockRegisterTranche(sh_mem->alert_tranche_id, &alert_tranche);
+
+  shmem_tranche.name = "orafce_shmem";
+  shmem_tranche.array_base = &sh_mem->shmem_lock;
+  shmem_tranche.array_stride = sizeof(LWLock);
+  LWLockRegisterTranche(sh_mem->shmem_tranche_id, &shmem_tranche);
+#endif
+} /* register_tranches() */
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Spill file of pipe holds messages, which didn't fit to its memory
+ * threshold. Every record is length and message buffer. While the file
+ * isn't empty, new messages are appended to it, and it is read after
+ * the queue in shared memory, so the order of messages is kept.
+ */
+#define SPILL_DIR    "pg_orafce"
+
+/*
+ * Removes spill files left by server, which didn't stop cleanly
+ */
+static void
+remove_spill_files (
+  void
+) {
+  DIR *dir;
+  struct dirent *de;
+  char path[MAXPGPATH];
+
+  if (NULL == (dir = AllocateDir(SPILL_DIR))) {
+    return;
+  }
+
+  while (NULL != (de = ReadDir(dir, SPILL_DIR))) {
+    if ((strcmp(de->d_name, ".") == 0) || (strcmp(de->d_name, "..") == 0)) {
+      continue;
+    }
+
+    snprintf(path, MAXPGPATH, "%s/%s", SPILL_DIR, de->d_name);
+    unlink(path);
+  }
+
+  FreeDir(dir);
+} /* remove_spill_files() */
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Attach shared memory, and initialize it, when it is used first time.
+ * Doesn't lock anything - pipes are locked by lock_pipe(), alerts by
+ * alert_lockid.
+ */
+bool
+ora_attach_shmem (
+  size_t size,
+  int    max_pipes,
+  int    max_events,
+  int    max_locks
+) {
+  int i;
+  bool found;
+  Size segment_size;
+  LWLockId shmem_lockid;
+  sh_memory *sh_mem;
+
+  if (pipes != NULL) {
+    return (true);
+  }
+
+  segment_size = ora_shmem_size(size, max_pipes, max_events, max_locks);
+
+  LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+  sh_mem = ShmemInitStruct("dbms_pipe", segment_size, &found);
+  if (sh_mem == NULL) {
+    ereport(FATAL,
+      (errcode(ERRCODE_OUT_OF_MEMORY),
+      errmsg("out of memory"),
+      errdetail("Failed while allocation block %lu bytes in shared memory.",
+      (unsigned long) segment_size)));
+  }
+
+  if (!found) {
+    pipe *p;
+    pipe_directory *d;
+    alert_event *e;
+    alert_lock *l;
+    alert_directory *ad;
+
+    p = sh_mem->pipes = (pipe *) sh_mem->data;
+    d = sh_mem->directory = (pipe_directory *)
+      (((char *) p) + pipes_size(max_pipes));
+    e = sh_mem->events = (alert_event *)
+      (((char *) d) + directory_size(max_pipes));
+    l = sh_mem->locks = (alert_lock *)
+      (((char *) e) + events_size(max_events));
+    ad = sh_mem->alert_dir = (alert_directory *)
+      (((char *) l) + locks_size(max_locks));
 
-      tranche.name = "orafce";
-      tranche.array_base = &sh_mem->shmem_lock;
-      tranche.array_stride = sizeof(LWLock);
-      LWLockRegisterTranche(sh_mem->tranche_id, &tranche);
+#if PG_VERSION_NUM >= 90600
+    sh_mem->directory_tranche_id = LWLockNewTrancheId();
+    sh_mem->pipe_tranche_id = LWLockNewTrancheId();
+    sh_mem->alert_tranche_id = LWLockNewTrancheId();
+    sh_mem->shmem_tranche_id = LWLockNewTrancheId();
+
+    LWLockInitialize(&sh_mem->directory_lock, sh_mem->directory_tranche_id);
+    LWLockInitialize(&sh_mem->alert_lock, sh_mem->alert_tranche_id);
+    LWLockInitialize(&sh_mem->shmem_lock, sh_mem->shmem_tranche_id);
+    shmem_lockid = &sh_mem->shmem_lock;
+#else
+    sh_mem->directory_lockid = LWLockAssign();
+    sh_mem->alert_lockid = LWLockAssign();
+    shmem_lockid = sh_mem->shmem_lockid = LWLockAssign();
 #endif
 
-      shmem_lockid = &sh_mem->shmem_lock;
+    sh_mem->size = size;
+    ora_sinit(((char *) ad) + alert_directory_size(max_events, max_locks),
+      size, true, shmem_lockid, &d->space_cv);
+
+    sh_mem->sid = 0;
+    remove_spill_files();
+    for (i = 0; i < max_pipes; i++) {
+#if PG_VERSION_NUM >= 90600
+      LWLockInitialize(&p[i].lock, sh_mem->pipe_tranche_id);
 #else
-      shmem_lockid = sh_mem->shmem_lockid;
+      p[i].lockid = LWLockAssign();
 #endif
+      p[i].is_valid = false;
+      p[i].spill_writing = false;
+      p[i].spill_reading = false;
+      p[i].spill_gen = 0;
+      p[i].hash_next = i + 1 < max_pipes ? i + 1 : NO_PIPE;
+    }
+
+    d->nbuckets = pipe_buckets(max_pipes);
+    d->free_pipe = 0;
+    d->pipes_version = 0;
+    ora_cv_init(&d->space_cv);
+    ora_cv_init(&d->data_cv);
+    for (i = 0; i < d->nbuckets; i++) {
+      d->buckets[i].first_pipe = NO_PIPE;
+      ora_cv_init(&d->buckets[i].cv);
+    }
 
-      pipes = sh_mem->pipes;
-      LWLockAcquire(shmem_lockid, LW_EXCLUSIVE);
+    for (i = 0; i < max_events; i++) {
+      e[i].event_name = NULL;
+      e[i].max_receivers = 0;
+      e[i].receivers = NULL;
+      e[i].messages = NULL;
+      e[i].hash_next = i + 1 < max_events ? i + 1 : NO_ALERT_ENTRY;
+    }
+    for (i = 0; i < max_locks; i++) {
+      l[i].sid = -1;
+      l[i].pending = 0;
+      ora_cv_init(&l[i].cv);
+      l[i].hash_next = i + 1 < max_locks ? i + 1 : NO_ALERT_ENTRY;
+    }
 
-      ora_sinit(sh_mem->data, sh_mem->size, reset);
-      sid = ++(sh_mem->sid);
-      events = sh_mem->events;
-      locks = sh_mem->locks;
+    ad->first_message = NULL;
+    ad->last_message = NULL;
+    ad->nevent_buckets = pipe_buckets(max_events);
+    ad->nlock_buckets = pipe_buckets(max_locks);
+    ad->free_event = max_events > 0 ? 0 : NO_ALERT_ENTRY;
+    ad->free_lock = max_locks > 0 ? 0 : NO_ALERT_ENTRY;
+    for (i = 0; i < ad->nevent_buckets + ad->nlock_buckets; i++) {
+      ad->buckets[i] = NO_ALERT_ENTRY;
     }
   } else {
-    LWLockAcquire(shmem_lockid, LW_EXCLUSIVE);
+#if PG_VERSION_NUM >= 90600
+    shmem_lockid = &sh_mem->shmem_lock;
+#else
+    shmem_lockid = sh_mem->shmem_lockid;
+#endif
+
+    ora_sinit(((char *) sh_mem->alert_dir) +
+      alert_directory_size(max_events, max_locks), sh_mem->size,
+      false, shmem_lockid, &sh_mem->directory->space_cv);
   }
 
-  return (pipes != NULL);
-} /* ora_lock_shmem() */
+  sid = ++(sh_mem->sid);
+
+  LWLockRelease(AddinShmemInitLock);
+
+  register_tranches(sh_mem);
+
+#if PG_VERSION_NUM >= 90600
+  directory_lockid = &sh_mem->directory_lock;
+  alert_lockid = &sh_mem->alert_lock;
+#else
+  directory_lockid = sh_mem->directory_lockid;
+  alert_lockid = sh_mem->alert_lockid;
+#endif
+
+  directory = sh_mem->directory;
+  events = sh_mem->events;
+  locks = sh_mem->locks;
+  alert_dir = sh_mem->alert_dir;
+  pipes = sh_mem->pipes;
+
+  return (true);
+} /* ora_attach_shmem() */
+
+/* ------------------------------------------------------------------------- */
+
+static uint32
+pipe_name_hash (
+  text *pipe_name
+) {
+  return (DatumGetUInt32(hash_any((unsigned char *) VARDATA(pipe_name),
+    VARSIZE(pipe_name) - VARHDRSZ)));
+} /* pipe_name_hash() */
+
+/* ------------------------------------------------------------------------- */
+
+#define pipe_bucket_of(hashval) \
+  (&directory->buckets[(hashval) & (directory->nbuckets - 1)])
+
+/* wakes receivers of pipe and receive_any, caller holds pipe lock */
+#define notify_receivers(p) \
+  do { \
+    (p)->data_version += 1; \
+    ora_cv_broadcast(&pipe_bucket_of((p)->hashval)->cv); \
+    ora_cv_broadcast(&directory->data_cv); \
+  } while (0)
+
+/*
+ * Returns condition variable signaled when message is sent to pipe.
+ */
+static ora_cv *
+pipe_cv (
+  text *pipe_name
+) {
+  return (&pipe_bucket_of(pipe_name_hash(pipe_name))->cv);
+} /* pipe_cv() */
 
 /* ------------------------------------------------------------------------- */
 
 /*
- * can be enhanced access/hash.h
+ * Returns pipe of pipe_name. When pipe doesn't exist and only_check is
+ * false, new pipe is registered.
  */
 static pipe *
 find_pipe (
@@ -368,18 +897,22 @@ find_pipe (
   bool  only_check
 ) {
   int i;
-  pipe *result = NULL;
+  int len = VARSIZE(pipe_name) - VARHDRSZ;
+  uint32 hashval;
+  int *bucket;
+
+  hashval = pipe_name_hash(pipe_name);
+  bucket = &pipe_bucket_of(hashval)->first_pipe;
 
   *created = false;
-  for (i = 0; i < MAX_PIPES; i++) {
-    if (pipes[i].is_valid &&
-      (strncmp((char *) VARDATA(pipe_name), pipes[i].pipe_name,
-      VARSIZE(pipe_name) - VARHDRSZ) == 0) &&
-      (strlen(pipes[i].pipe_name) == (VARSIZE(pipe_name) - VARHDRSZ))) {
+  for (i = *bucket; i != NO_PIPE; i = pipes[i].hash_next) {
+    if ((pipes[i].hashval == hashval) &&
+      (strncmp((char *) VARDATA(pipe_name), pipes[i].pipe_name, len) == 0) &&
+      (strlen(pipes[i].pipe_name) == (size_t) len)) {
       /* check owner if non public pipe */
 
       if ((pipes[i].creator != NULL) && (pipes[i].uid != GetUserId())) {
-        LWLockRelease(shmem_lockid);
+        LWLockRelease(directory_lockid);
         ereport(ERROR,
           (errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
           errmsg("insufficient privilege"),
@@ -390,882 +923,3614 @@ find_pipe (
     }
   }
 
-  if (only_check) {
-    return (result);
+  if (only_check || (NO_PIPE == (i = directory->free_pipe))) {
+    return (NULL);
   }
 
-  for (i = 0; i < MAX_PIPES; i++) {
-    if (!pipes[i].is_valid) {
-      if (NULL != (pipes[i].pipe_name = ora_scstring(pipe_name))) {
-        pipes[i].is_valid = true;
-        pipes[i].registered = false;
-        pipes[i].creator = NULL;
-        pipes[i].uid = -1;
-        pipes[i].count = 0;
-        pipes[i].limit = -1;
-
-        *created = true;
-        result = &pipes[i];
-      }
-      break;
-    }
+  if (NULL == (pipes[i].pipe_name = ora_scstring(pipe_name))) {
+    return (NULL);
   }
 
-  return (result);
+  directory->free_pipe = pipes[i].hash_next;
+  directory->pipes_version += 1;
+
+  pipes[i].is_valid = true;
+  pipes[i].registered = false;
+  pipes[i].creator = NULL;
+  pipes[i].uid = -1;
+  pipes[i].count = 0;
+  pipes[i].limit = -1;
+  pipes[i].items = NULL;
+  pipes[i].last_item = NULL;
+  pipes[i].size = 0;
+  pipes[i].hashval = hashval;
+  memset(&pipes[i].stats, 0, sizeof(pipe_stats));
+  pipes[i].fanout = false;
+  pipes[i].subscribers = NULL;
+  pipes[i].nsubscribers = 0;
+  pipes[i].max_subscribers = 0;
+  pipes[i].spill_threshold = 0;
+  /* spill_writing and spill_reading are cleared by writer and reader */
+  pipes[i].spill_count = 0;
+  pipes[i].spill_read_off = 0;
+  pipes[i].spill_ready_off = 0;
+  pipes[i].spill_write_off = 0;
+  pipes[i].spill_gen += 1;
+  pipes[i].ttl = 0;
+  pipes[i].expiring = 0;
+  pipes[i].data_version = 0;
+  pipes[i].hash_next = *bucket;
+  *bucket = i;
+
+  *created = true;
+
+  return (&pipes[i]);
 } /* find_pipe() */
 
 /* ------------------------------------------------------------------------- */
 
-static bool
-new_last (
-  pipe *p,
-  void *ptr
+/*
+ * Unregister pipe - remove it from hash and return it to free list.
+ */
+static void
+release_pipe (
+  pipe *p
 ) {
-  queue_item *q, *aux_q;
+  int i = p - pipes;
+  int *link = &pipe_bucket_of(p->hashval)->first_pipe;
 
-  if ((p->count >= p->limit) && (p->limit != -1)) {
-    return (false);
+  while (*link != i) {
+    Assert(*link != NO_PIPE);
+    link = &pipes[*link].hash_next;
   }
+  *link = p->hash_next;
 
-  if (p->items == NULL) {
-    if (NULL == (p->items = ora_salloc(sizeof(queue_item)))) {
-      return (false);
-    }
-    p->items->next_item = NULL;
-    p->items->ptr = ptr;
-    p->count = 1;
-    return (true);
+  ora_sfree(p->pipe_name);
+  if (p->creator != NULL) {
+    ora_sfree(p->creator);
   }
-  q = p->items;
-  while (q->next_item != NULL) {
-    q = q->next_item;
-  }
-
-  if (NULL == (aux_q = ora_salloc(sizeof(queue_item)))) {
-    return (false);
+  if (p->subscribers != NULL) {
+    ora_sfree(p->subscribers);
   }
+  p->is_valid = false;
 
-  q->next_item = aux_q;
-  aux_q->next_item = NULL;
-  aux_q->ptr = ptr;
-
-  p->count += 1;
-
-  return (true);
-} /* new_last() */
+  p->hash_next = directory->free_pipe;
+  directory->free_pipe = i;
+} /* release_pipe() */
 
 /* ------------------------------------------------------------------------- */
 
-static void *
-remove_first (
-  pipe *p,
-  bool *found
+/*
+ * Find pipe and lock it. When pipe doesn't exist and only_check is
+ * false, the pipe is registered. Pipe directory stays locked - in shared
+ * mode, or exclusively when the pipe was registered (created is true).
+ * Both locks are released by unlock_pipe().
+ */
+static pipe *
+lock_pipe (
+  text *pipe_name,
+  bool *created,
+  bool  only_check
 ) {
-  struct _queue_item *q;
-  void *ptr = NULL;
+  pipe *p;
 
-  *found = false;
+  LWLockAcquire(directory_lockid, LW_SHARED);
 
-  if (NULL != (q = p->items)) {
-    p->count -= 1;
-    ptr = q->ptr;
-    p->items = q->next_item;
-    *found = true;
+  if ((NULL == (p = find_pipe(pipe_name, created, true))) && !only_check) {
+    /* registration needs exclusive lock, somebody can be faster */
+    LWLockRelease(directory_lockid);
+    LWLockAcquire(directory_lockid, LW_EXCLUSIVE);
 
-    ora_sfree(q);
-    if ((p->items == NULL) && !p->registered) {
-      ora_sfree(p->pipe_name);
-      p->is_valid = false;
-    }
+    p = find_pipe(pipe_name, created, false);
   }
 
-  return (ptr);
-} /* remove_first() */
+  if (p == NULL) {
+    LWLockRelease(directory_lockid);
+    return (NULL);
+  }
 
-/* ------------------------------------------------------------------------- */
+  LWLockAcquire(pipe_lockid(p), LW_EXCLUSIVE);
 
-/* copy message to local memory, if exists */
+  return (p);
+} /* lock_pipe() */
 
-static message_buffer *
-get_from_pipe (
-  text *pipe_name,
-  bool *found
+/* ------------------------------------------------------------------------- */
+
+static void
+unlock_pipe (
+  pipe *p
+) {
+  LWLockRelease(pipe_lockid(p));
+  LWLockRelease(directory_lockid);
+} /* unlock_pipe() */
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Implicitly created pipe is removed with its last message. It needs
+ * exclusive lock of directory, so it is done after unlock_pipe(), when
+ * the pipe might be used by somebody again.
+ */
+static void
+release_empty_pipe (
+  text *pipe_name
 ) {
   pipe *p;
   bool created;
-  message_buffer *shm_msg;
-  message_buffer *result = NULL;
 
-  if (!ora_lock_shmem(SHMEMMSGSZ, MAX_PIPES, MAX_EVENTS, MAX_LOCKS, false)) {
-    return (NULL);
-  }
-
-  if (NULL != (p = find_pipe(pipe_name, &created, false))) {
-    if (!created) {
-      if (NULL != (shm_msg = remove_first(p, found))) {
-        p->size -= shm_msg->size;
+  LWLockAcquire(directory_lockid, LW_EXCLUSIVE);
 
-        result = (message_buffer *) MemoryContextAlloc(TopMemoryContext,
-            shm_msg->size);
-        memcpy(result, shm_msg, shm_msg->size);
-        ora_sfree(shm_msg);
-      }
+  if (NULL != (p = find_pipe(pipe_name, &created, true))) {
+    if ((p->items == NULL) && !p->registered) {
+      release_pipe(p);
     }
   }
 
-  LWLockRelease(shmem_lockid);
-
-  return (result);
-} /* get_from_pipe() */
+  LWLockRelease(directory_lockid);
+} /* release_empty_pipe() */
 
 /* ------------------------------------------------------------------------- */
 
 /*
- * if ptr is null, then only register pipe
+ * Items of fan-out pipe are read in order by all subscribers, so the
+ * items read by everybody are at head of queue.
  */
-static bool
-add_to_pipe (
-  text           *pipe_name,
-  message_buffer *ptr,
-  int             limit,
-  bool            limit_is_valid
+static void
+free_read_items (
+  pipe *p
 ) {
-  pipe *p;
-  bool created;
-  bool result = false;
-  message_buffer *sh_ptr;
+  bool freed = false;
 
-  if (!ora_lock_shmem(SHMEMMSGSZ, MAX_PIPES, MAX_EVENTS, MAX_LOCKS, false)) {
-    return (false);
-  }
+  while ((p->items != NULL) && (p->items->refs <= 0)) {
+    queue_item *q = p->items;
 
-  for ( ; ;) {
-    if (NULL != (p = find_pipe(pipe_name, &created, false))) {
-      if (created) {
-        p->registered = ptr == NULL;
-      }
+    p->items = q->next_item;
+    if (q->ptr != NULL) {
+      p->size -= ((message_buffer *) q->ptr)->size;
+      ora_sfree(q->ptr);
+    }
+    if (q->expires != 0) {
+      p->expiring -= 1;
+    }
+    ora_sfree(q);
 
-      if (limit_is_valid && (created || (p->limit < limit))) {
-        p->limit = limit;
-      }
+    p->count -= 1;
+    freed = true;
+  }
 
-      if (ptr != NULL) {
-        if (NULL != (sh_ptr = ora_salloc(ptr->size))) {
-          memcpy(sh_ptr, ptr, ptr->size);
-          if (new_last(p, sh_ptr)) {
-            p->size += ptr->size;
-            result = true;
-            break;
-          }
-          ora_sfree(sh_ptr);
-        }
-        if (created) {
-          /* I created new pipe, but haven't memory for new value */
-          ora_sfree(p->pipe_name);
-          p->is_valid = false;
-          result = false;
-        }
-      } else {
-        result = true;
-      }
-    }
-    break;
+  if (p->items == NULL) {
+    p->last_item = NULL;
   }
-  LWLockRelease(shmem_lockid);
-  return (result);
-} /* add_to_pipe() */
+
+  if (freed) {
+    ora_cv_broadcast(&directory->space_cv);
+  }
+} /* free_read_items() */
 
 /* ------------------------------------------------------------------------- */
 
-static void
-remove_pipe (
-  text *pipe_name,
-  bool  purge
+static subscriber *
+find_subscriber (
+  pipe *p
 ) {
-  pipe *p;
-  bool created;
-
-  if (NULL != (p = find_pipe(pipe_name, &created, true))) {
-    queue_item *q = p->items;
-    while (q != NULL) {
-      queue_item *aux_q;
+  int i;
 
-      aux_q = q->next_item;
-      if (q->ptr) {
-        ora_sfree(q->ptr);
-      }
-      ora_sfree(q);
-      q = aux_q;
-    }
-    p->items = NULL;
-    p->size = 0;
-    p->count = 0;
-    if (!(purge && p->registered)) {
-      ora_sfree(p->pipe_name);
-      p->is_valid = false;
+  for (i = 0; i < p->nsubscribers; i++) {
+    if (p->subscribers[i].sid == sid) {
+      return (&p->subscribers[i]);
     }
   }
-} /* remove_pipe() */
+
+  return (NULL);
+} /* find_subscriber() */
 
 /* ------------------------------------------------------------------------- */
 
-Datum
-dbms_pipe_next_item_type (
-  PG_FUNCTION_ARGS
+/*
+ * Unsubscribed session won't read its unread items
+ */
+static void
+remove_subscriber (
+  pipe       *p,
+  subscriber *s
 ) {
-  PG_RETURN_INT32(
-    input_buffer != NULL ? input_buffer->next->type : IT_NO_MORE_ITEMS);
-} /* dbms_pipe_next_item_type() */
+  queue_item *q;
+
+  for (q = s->cursor; q != NULL; q = q->next_item) {
+    q->refs -= 1;
+  }
+
+  *s = p->subscribers[--p->nsubscribers];
+
+  free_read_items(p);
+} /* remove_subscriber() */
 
 /* ------------------------------------------------------------------------- */
 
 static void
-init_buffer (
-  message_buffer *buffer,
-  int32           size
+not_subscribed_error (
+  void
 ) {
-  memset(buffer, 0, size);
-  buffer->size = message_buffer_size;
-  buffer->items_count = 0;
-  buffer->next = message_buffer_get_content(buffer);
-} /* init_buffer() */
+  ereport(ERROR,
+    (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+    errmsg("session is not subscribed to pipe"),
+    errdetail("Messages of fan-out pipe are received only by subscribers."),
+    errhint("Use dbms_pipe.subscribe first.")));
+} /* not_subscribed_error() */
 
 /* ------------------------------------------------------------------------- */
 
-static message_buffer *
-check_buffer (
-  message_buffer *buffer,
-  int32           size
+static bool
+new_last (
+  pipe       *p,
+  void       *ptr,
+  TimestampTz expires
 ) {
-  if (buffer == NULL) {
-    buffer = (message_buffer *) MemoryContextAlloc(TopMemoryContext, size);
-    if (buffer == NULL) {
-      ereport(ERROR,
-        (errcode(ERRCODE_OUT_OF_MEMORY),
-        errmsg("out of memory"),
-        errdetail("Failed while allocation block %d bytes in memory.", size)));
-    }
+  queue_item *q;
 
-    init_buffer(buffer, size);
+  if ((p->count >= p->limit) && (p->limit != -1)) {
+    return (false);
   }
 
-  return (buffer);
-} /* check_buffer() */
+  if (NULL == (q = ora_salloc(sizeof(queue_item)))) {
+    return (false);
+  }
 
-/* ------------------------------------------------------------------------- */
+  q->next_item = NULL;
+  q->ptr = ptr;
+  q->refs = 0;
+  q->expires = expires;
 
-Datum
-dbms_pipe_pack_message_text (
-  PG_FUNCTION_ARGS
-) {
-  text *str = PG_GETARG_TEXT_PP(0);
+  if (p->items == NULL) {
+    p->items = q;
+  } else {
+    p->last_item->next_item = q;
+  }
+  p->last_item = q;
 
-  output_buffer = check_buffer(output_buffer, LOCALMSGSZ);
-  pack_field(output_buffer, IT_VARCHAR,
-    VARSIZE_ANY_EXHDR(str), VARDATA_ANY(str), InvalidOid);
+  p->count += 1;
+  if (expires != 0) {
+    p->expiring += 1;
+  }
 
-  PG_RETURN_VOID();
-} /* dbms_pipe_pack_message_text() */
+  p->stats.sent += 1;
+  if (ptr != NULL) {
+    p->size += ((message_buffer *) ptr)->size;
+    p->stats.bytes_sent += ((message_buffer *) ptr)->size;
+  }
+  p->stats.max_count = Max(p->stats.max_count, p->count);
 
-/* ------------------------------------------------------------------------- */
+  if (p->fanout) {
+    int i;
 
-Datum
-dbms_pipe_pack_message_date (
-  PG_FUNCTION_ARGS
-) {
-  DateADT dt = PG_GETARG_DATEADT(0);
+    /* subscribers, who have read all, continue with new item */
+    q->refs = p->nsubscribers;
+    for (i = 0; i < p->nsubscribers; i++) {
+      if (p->subscribers[i].cursor == NULL) {
+        p->subscribers[i].cursor = q;
+      }
+    }
 
-  output_buffer = check_buffer(output_buffer, LOCALMSGSZ);
-  pack_field(output_buffer, IT_DATE,
-    sizeof(dt), &dt, InvalidOid);
+    /* without subscribers the message is dropped */
+    free_read_items(p);
+  }
 
-  PG_RETURN_VOID();
-} /* dbms_pipe_pack_message_date() */
+  return (true);
+} /* new_last() */
 
 /* ------------------------------------------------------------------------- */
 
-Datum
-dbms_pipe_pack_message_timestamp (
-  PG_FUNCTION_ARGS
+static void *
+remove_first (
+  pipe *p,
+  bool *found
 ) {
-  TimestampTz dt = PG_GETARG_TIMESTAMPTZ(0);
+  struct _queue_item *q;
+  void *ptr = NULL;
 
-  output_buffer = check_buffer(output_buffer, LOCALMSGSZ);
-  pack_field(output_buffer, IT_TIMESTAMPTZ,
-    sizeof(dt), &dt, InvalidOid);
+  *found = false;
 
-  PG_RETURN_VOID();
-} /* dbms_pipe_pack_message_timestamp() */
+  if (NULL != (q = p->items)) {
+    p->count -= 1;
+    if (q->expires != 0) {
+      p->expiring -= 1;
+    }
+    ptr = q->ptr;
+    p->items = q->next_item;
+    if (p->items == NULL) {
+      p->last_item = NULL;
+    }
+    *found = true;
+
+    p->stats.received += 1;
+    if (ptr != NULL) {
+      p->stats.bytes_received += ((message_buffer *) ptr)->size;
+    }
+
+    ora_sfree(q);
+  }
+
+  return (ptr);
+} /* remove_first() */
 
 /* ------------------------------------------------------------------------- */
 
-Datum
-dbms_pipe_pack_message_number (
-  PG_FUNCTION_ARGS
+/*
+ * Messages with time to live are removed lazily - from head of queue,
+ * when the pipe is read, and from whole queue, when there is no space
+ * for new message. Subscribers of fan-out pipe, whose next unread item
+ * expired, continue with the next one.
+ */
+static void
+remove_expired (
+  pipe *p,
+  bool  whole_queue
 ) {
-  Numeric num = PG_GETARG_NUMERIC(0);
+  TimestampTz now;
+  queue_item *prev = NULL;
+  queue_item *q;
+  bool freed = false;
 
-  output_buffer = check_buffer(output_buffer, LOCALMSGSZ);
-  pack_field(output_buffer, IT_NUMBER,
-    VARSIZE(num) - VARHDRSZ, VARDATA(num), InvalidOid);
+  if (p->expiring == 0) {
+    return;
+  }
 
-  PG_RETURN_VOID();
-} /* dbms_pipe_pack_message_number() */
+  now = GetCurrentTimestamp();
 
-/* ------------------------------------------------------------------------- */
+  q = p->items;
+  while (q != NULL) {
+    queue_item *next = q->next_item;
 
-Datum
-dbms_pipe_pack_message_bytea (
-  PG_FUNCTION_ARGS
-) {
-  bytea *data = PG_GETARG_BYTEA_P(0);
+    if ((q->expires != 0) && (q->expires <= now)) {
+      int i;
 
-  output_buffer = check_buffer(output_buffer, LOCALMSGSZ);
-  pack_field(output_buffer, IT_BYTEA,
-    VARSIZE_ANY_EXHDR(data), VARDATA_ANY(data), InvalidOid);
+      if (prev == NULL) {
+        p->items = next;
+      } else {
+        prev->next_item = next;
+      }
+      if (p->last_item == q) {
+        p->last_item = prev;
+      }
 
-  PG_RETURN_VOID();
-} /* dbms_pipe_pack_message_bytea() */
+      for (i = 0; i < p->nsubscribers; i++) {
+        if (p->subscribers[i].cursor == q) {
+          p->subscribers[i].cursor = next;
+        }
+      }
+
+      if (q->ptr != NULL) {
+        p->size -= ((message_buffer *) q->ptr)->size;
+        ora_sfree(q->ptr);
+      }
+      ora_sfree(q);
+
+      p->count -= 1;
+      p->expiring -= 1;
+      p->stats.expired += 1;
+      freed = true;
+    } else if (!whole_queue) {
+      break;
+    } else {
+      prev = q;
+    }
+
+    q = next;
+  }
+
+  if (freed) {
+    ora_cv_broadcast(&directory->space_cv);
+  }
+} /* remove_expired() */
 
 /* ------------------------------------------------------------------------- */
 
+/*
+ * When shared memory is exhausted, expired messages of all pipes are
+ * removed. Caller holds lock of pipe p and the directory lock, other
+ * pipes are skipped when they are locked, so sessions cannot deadlock.
+ */
 static void
-init_args_3 (
-  FunctionCallInfo info,
-  Datum            arg0,
-  Datum            arg1,
-  Datum            arg2
+remove_expired_everywhere (
+  pipe *p
 ) {
-#if PG_VERSION_NUM >= 120000
-  info->args[0].value = arg0;
-  info->args[1].value = arg1;
-  info->args[2].value = arg2;
-  info->args[0].isnull = false;
-  info->args[1].isnull = false;
-  info->args[2].isnull = false;
-#else
-  info->arg[0] = arg0;
-  info->arg[1] = arg1;
-  info->arg[2] = arg2;
-  info->argnull[0] = false;
-  info->argnull[1] = false;
-  info->argnull[2] = false;
-#endif
-} /* init_args_3() */
+  int i;
+
+  remove_expired(p, true);
+
+  for (i = 0; i < MAX_PIPES; i++) {
+    pipe *other = &pipes[i];
+
+    if ((other == p) || !other->is_valid || (other->expiring == 0)) {
+      continue;
+    }
+
+    if (LWLockConditionalAcquire(pipe_lockid(other), LW_EXCLUSIVE)) {
+      remove_expired(other, true);
+      LWLockRelease(pipe_lockid(other));
+    }
+  }
+} /* remove_expired_everywhere() */
 
 /* ------------------------------------------------------------------------- */
 
 /*
- *  We can serialize only typed record
+ * Message bigger than orafce.pipe_compression_threshold is stored
+ * compressed by lz4, when server is built with it (PostgreSQL 14 and
+ * newer), else by pglz. Only items are compressed, raw_size of header
+ * is the size of original message.
  */
-Datum
-dbms_pipe_pack_message_record (
-  PG_FUNCTION_ARGS
+static message_buffer *
+compress_message (
+  message_buffer *msg
 ) {
-  HeapTupleHeader rec = PG_GETARG_HEAPTUPLEHEADER(0);
-  Oid tupType;
-  bytea *data;
+#if PG_VERSION_NUM >= 90500
+  message_buffer *result;
+  int32 len = msg->size - message_buffer_size;
+  int32 clen;
+
+  if ((orafce_pipe_compression_threshold == 0) ||
+    (msg->size < (Size) orafce_pipe_compression_threshold * 1024) ||
+    (msg->raw_size > 0)) {
+    return (msg);
+  }
 
-#if PG_VERSION_NUM >= 120000
-  LOCAL_FCINFO(info, 3);
+#ifdef ORA_USE_LZ4
+  result = (message_buffer *) palloc(message_buffer_size +
+      LZ4_compressBound(len));
+
+  clen = LZ4_compress_default((char *) msg + message_buffer_size,
+      (char *) result + message_buffer_size, len, LZ4_compressBound(len));
+  result->compression = MC_LZ4;
+
+  /* lz4 fails with 0, data, which don't shrink, are sent raw too */
+  if ((clen <= 0) || (clen >= len)) {
+    clen = -1;
+  }
 #else
-  FunctionCallInfoData info_data;
-  FunctionCallInfo info = &info_data;
+  result = (message_buffer *) palloc(message_buffer_size +
+      PGLZ_MAX_OUTPUT(len));
+
+  clen = pglz_compress((char *) msg + message_buffer_size, len,
+      (char *) result + message_buffer_size, PGLZ_strategy_default);
+  result->compression = MC_PGLZ;
 #endif
 
-  tupType = HeapTupleHeaderGetTypeId(rec);
+  /* incompressible data are sent raw */
+  if (clen < 0) {
+    pfree(result);
+    return (msg);
+  }
 
-  /*
-   * Normally one would call record_send() using DirectFunctionCall3,
-   * but that does not work since record_send wants to cache some data
-   * using fcinfo->flinfo->fn_extra.  So we need to pass it our own
-   * flinfo parameter.
-   */
-  InitFunctionCallInfoData(*info, fcinfo->flinfo, 3, InvalidOid, NULL, NULL);
-  init_args_3(info, PointerGetDatum(rec), ObjectIdGetDatum(
-      tupType), Int32GetDatum(-1));
+  result->size = message_buffer_size + clen;
+  result->items_count = msg->items_count;
+  result->raw_size = msg->size;
+  result->next = NULL;
 
-  data = (bytea *) DatumGetPointer(record_send(info));
-
-  output_buffer = check_buffer(output_buffer, LOCALMSGSZ);
-  pack_field(output_buffer, IT_RECORD,
-    VARSIZE(data), VARDATA(data), tupType);
-
-  PG_RETURN_VOID();
-} /* dbms_pipe_pack_message_record() */
+  return (result);
+#else
+  return (msg);
+#endif
+} /* compress_message() */
 
 /* ------------------------------------------------------------------------- */
 
-static Datum
-dbms_pipe_unpack_message (
-  PG_FUNCTION_ARGS,
-  message_data_type dtype
+/*
+ * Returns raw message allocated in mcxt, compressed message is released
+ */
+static message_buffer *
+decompress_message (
+  message_buffer *msg,
+  MemoryContext   mcxt
 ) {
-  Oid tupType;
-  void *ptr;
-  message_data_type type;
-  int32 size;
-  Datum result;
-  message_data_type next_type;
-
-  if ((input_buffer == NULL) ||
-    (input_buffer->items_count <= 0) ||
-    (input_buffer->next == NULL) ||
-    (input_buffer->next->type == IT_NO_MORE_ITEMS)) {
-    PG_RETURN_NULL();
-  }
+#if PG_VERSION_NUM >= 90500
+  message_buffer *result;
+  int32 len;
+  int32 dlen = -1;
 
-  next_type = input_buffer->next->type;
-  if (next_type != dtype) {
-    ereport(ERROR,
-      (errcode(ERRCODE_DATATYPE_MISMATCH),
-      errmsg("datatype mismatch"),
-      errdetail("unpack unexpected type: %d", next_type)));
+  if ((msg == NULL) || (msg->raw_size == 0)) {
+    return (msg);
   }
 
-  ptr = unpack_field(input_buffer, &type, &size, &tupType);
-  Assert(ptr != NULL);
+  len = msg->raw_size - message_buffer_size;
+  result = (message_buffer *) MemoryContextAlloc(mcxt, msg->raw_size);
 
-  switch (type)
+  switch (msg->compression)
   {
-    case IT_TIMESTAMPTZ:
-      result = TimestampTzGetDatum(*(TimestampTz *) ptr);
+    case MC_PGLZ:
+      dlen = pglz_decompress((char *) msg + message_buffer_size,
+          msg->size - message_buffer_size,
+          (char *) result + message_buffer_size, len
+#if PG_VERSION_NUM >= 120000
+          , true
+#endif
+          );
       break;
 
-    case IT_DATE:
-      result = DateADTGetDatum(*(DateADT *) ptr);
+#ifdef ORA_USE_LZ4
+    case MC_LZ4:
+      dlen = LZ4_decompress_safe((char *) msg + message_buffer_size,
+          (char *) result + message_buffer_size,
+          msg->size - message_buffer_size, len);
       break;
+#endif
 
-    case IT_VARCHAR:
-    case IT_NUMBER:
-    case IT_BYTEA:
-      result = PointerGetDatum(cstring_to_text_with_len(ptr, size));
+    default:
       break;
+  }
 
-    case IT_RECORD:
-      {
-#if PG_VERSION_NUM >= 120000
-        LOCAL_FCINFO(info, 3);
+  if (dlen != len) {
+    ereport(ERROR,
+      (errcode(ERRCODE_DATA_CORRUPTED),
+      errmsg("compressed message is corrupted")));
+  }
+
+  result->size = msg->raw_size;
+  result->items_count = msg->items_count;
+  result->raw_size = 0;
+  result->compression = MC_PGLZ;
+  result->next = NULL;
+  input_bytes_copied += len;
+
+  pfree(msg);
+
+  return (result);
 #else
-        FunctionCallInfoData info_data;
-        FunctionCallInfo info = &info_data;
+  return (msg);
 #endif
+} /* decompress_message() */
 
-        StringInfoData buf;
-        text *data = cstring_to_text_with_len(ptr, size);
-
-        buf.data = VARDATA(data);
-        buf.len = VARSIZE(data) - VARHDRSZ;
-        buf.maxlen = buf.len;
-        buf.cursor = 0;
-
-        /*
-         * Normally one would call record_recv() using DirectFunctionCall3,
-         * but that does not work since record_recv wants to cache some data
-         * using fcinfo->flinfo->fn_extra.  So we need to pass it our own
-         * flinfo parameter.
-         */
-        InitFunctionCallInfoData(*info, fcinfo->flinfo, 3, InvalidOid, NULL,
-          NULL);
-        init_args_3(info, PointerGetDatum(&buf), ObjectIdGetDatum(
-            tupType), Int32GetDatum(-1));
-
-        result = record_recv(info);
-        break;
-      }
+/* ------------------------------------------------------------------------- */
 
-    default:
-      elog(ERROR, "unexpected type: %d", type);
-      result = (Datum) 0; /* keep compiler quiet */
-  }
+#if PG_VERSION_NUM >= 110000
+#define open_spill_file(path, flags) \
+  OpenTransientFile(path, (flags) | PG_BINARY)
+#define make_spill_dir()    MakePGDirectory(SPILL_DIR)
+#else
+#define open_spill_file(path, flags) \
+  OpenTransientFile(path, (flags) | PG_BINARY, S_IRUSR | S_IWUSR)
+#define make_spill_dir()    mkdir(SPILL_DIR, S_IRWXU)
+#endif
 
-  if (input_buffer->items_count == 0) {
-    pfree(input_buffer);
-    input_buffer = NULL;
-  }
+#define spill_record_size(size) \
+  ((off_t) (sizeof(int32) + sizeof(TimestampTz) + (size)))
 
-  PG_RETURN_DATUM(result);
-} /* dbms_pipe_unpack_message() */
+/*
+ * Messages are reserved in spill file under pipe lock and written after
+ * the lock is released, so nobody waits for file I/O. Only one backend
+ * writes to spill file of pipe, reserved messages are invisible for
+ * readers until they are written.
+ */
+typedef struct {
+  int               pipe_nth;
+  uint32            gen;        /* spill_gen of pipe at reservation */
+  off_t             off;        /* offset of first reserved message */
+  int               n;
+  int               size;
+  message_buffer  **messages;
+  TimestampTz      *expires;
+} spill_batch;
 
-/* ------------------------------------------------------------------------- */
+/*
+ * Spilled messages are reserved for one reader under pipe lock too, and
+ * read by read_spilled_messages after the lock is released. Reader takes
+ * at most max_count messages, which were written at reservation.
+ */
+typedef struct {
+  int               pipe_nth;   /* -1, when nothing is reserved */
+  uint32            gen;        /* spill_gen of pipe at reservation */
+  off_t             off;        /* offset of first unread message */
+  off_t             end;        /* end of written messages */
+  int               max_count;
+} spill_read;
 
-Datum
-dbms_pipe_unpack_message_text (
-  PG_FUNCTION_ARGS
+static void
+spill_file_path (
+  pipe *p,
+  char *path
 ) {
-  return (dbms_pipe_unpack_message(fcinfo, IT_VARCHAR));
-} /* dbms_pipe_unpack_message_text() */
+  snprintf(path, MAXPGPATH, "%s/pipe_%d.spill", SPILL_DIR, (int) (p - pipes));
+} /* spill_file_path() */
 
 /* ------------------------------------------------------------------------- */
 
-Datum
-dbms_pipe_unpack_message_date (
-  PG_FUNCTION_ARGS
+static void
+spill_file_error (
+  const char *action,
+  const char *path
 ) {
-  return (dbms_pipe_unpack_message(fcinfo, IT_DATE));
-} /* dbms_pipe_unpack_message_date() */
+  ereport(ERROR,
+    (errcode_for_file_access(),
+    errmsg("could not %s spill file \"%s\": %m", action, path)));
+} /* spill_file_error() */
 
 /* ------------------------------------------------------------------------- */
 
-Datum
-dbms_pipe_unpack_message_timestamp (
-  PG_FUNCTION_ARGS
+static void
+remove_spill_file (
+  pipe *p
 ) {
-  return (dbms_pipe_unpack_message(fcinfo, IT_TIMESTAMPTZ));
-} /* dbms_pipe_unpack_message_timestamp() */
+  char path[MAXPGPATH];
+
+  if (p->spill_write_off > 0) {
+    spill_file_path(p, path);
+    if ((unlink(path) < 0) && (errno != ENOENT)) {
+      ereport(WARNING,
+        (errcode_for_file_access(),
+        errmsg("could not remove spill file \"%s\": %m", path)));
+    }
+  }
+
+  p->spill_count = 0;
+  p->spill_read_off = 0;
+  p->spill_ready_off = 0;
+  p->spill_write_off = 0;
+  p->spill_gen += 1;
+} /* remove_spill_file() */
 
 /* ------------------------------------------------------------------------- */
 
-Datum
-dbms_pipe_unpack_message_number (
-  PG_FUNCTION_ARGS
+/*
+ * Reserves place for message in spill file. Returns false, when other
+ * backend writes to spill file of the pipe.
+ */
+static bool
+reserve_spill (
+  pipe           *p,
+  message_buffer *msg,
+  TimestampTz     expires,
+  spill_batch    *batch
 ) {
-  return (dbms_pipe_unpack_message(fcinfo, IT_NUMBER));
-} /* dbms_pipe_unpack_message_number() */
+  if (batch->n == 0) {
+    if (p->spill_writing) {
+      return (false);
+    }
+
+    p->spill_writing = true;
+    batch->pipe_nth = p - pipes;
+    batch->gen = p->spill_gen;
+    batch->off = p->spill_write_off;
+  }
+
+  if (batch->n >= batch->size) {
+    batch->size = batch->size > 0 ? batch->size * 2 : 8;
+    batch->messages = batch->messages != NULL ?
+      repalloc(batch->messages, batch->size * sizeof(message_buffer *)) :
+      palloc(batch->size * sizeof(message_buffer *));
+    batch->expires = batch->expires != NULL ?
+      repalloc(batch->expires, batch->size * sizeof(TimestampTz)) :
+      palloc(batch->size * sizeof(TimestampTz));
+  }
+
+  batch->messages[batch->n] = msg;
+  batch->expires[batch->n] = expires;
+  batch->n += 1;
+
+  p->spill_write_off += spill_record_size(msg->size);
+  p->count += 1;
+
+  return (true);
+} /* reserve_spill() */
 
 /* ------------------------------------------------------------------------- */
 
-Datum
-dbms_pipe_unpack_message_bytea (
-  PG_FUNCTION_ARGS
+/*
+ * Writes messages reserved by reserve_spill and makes them visible for
+ * readers. Caller doesn't hold any lock. Every message is written at its
+ * reserved offset, so a failed write leaves nothing, what could be read,
+ * the reservation is returned and the next messages overwrite it.
+ */
+static void
+write_spilled_messages (
+  spill_batch *batch
 ) {
-  return (dbms_pipe_unpack_message(fcinfo, IT_BYTEA));
-} /* dbms_pipe_unpack_message_bytea() */
+  char path[MAXPGPATH];
+  const char *action = NULL;
+  int save_errno = 0;
+  off_t off = batch->off;
+  pipe *p;
+  int fd;
+  int i;
+
+  if (batch->n == 0) {
+    return;
+  }
+
+  p = &pipes[batch->pipe_nth];
+  spill_file_path(p, path);
+
+  if ((make_spill_dir() < 0) && (errno != EEXIST)) {
+    action = "create directory of";
+    save_errno = errno;
+  } else if ((fd = open_spill_file(path, O_WRONLY | O_CREAT)) < 0) {
+    action = "open";
+    save_errno = errno;
+  } else {
+    for (i = 0; i < batch->n; i++) {
+      message_buffer *msg = batch->messages[i];
+
+      errno = 0;
+      if ((pwrite(fd, &msg->size, sizeof(int32), off) != sizeof(int32)) ||
+        (pwrite(fd, &batch->expires[i], sizeof(TimestampTz),
+          off + sizeof(int32)) != sizeof(TimestampTz)) ||
+        (pwrite(fd, msg, msg->size, off + sizeof(int32) +
+          sizeof(TimestampTz)) != msg->size)) {
+        /* short write doesn't set errno, probably out of disk space */
+        action = "write to";
+        save_errno = errno != 0 ? errno : ENOSPC;
+        break;
+      }
+
+      off += spill_record_size(msg->size);
+    }
+
+    CloseTransientFile(fd);
+  }
+
+  LWLockAcquire(directory_lockid, LW_SHARED);
+  LWLockAcquire(pipe_lockid(p), LW_EXCLUSIVE);
+
+  Assert(p->spill_writing);
+  p->spill_writing = false;
+
+  if (p->is_valid && (p->spill_gen == batch->gen)) {
+    if (action == NULL) {
+      p->spill_ready_off = off;
+      p->spill_count += batch->n;
+
+      for (i = 0; i < batch->n; i++) {
+        p->stats.sent += 1;
+        p->stats.bytes_sent += batch->messages[i]->size;
+      }
+      p->stats.max_count = Max(p->stats.max_count, p->count);
+
+      notify_receivers(p);
+    } else {
+      p->spill_write_off = batch->off;
+      p->count -= batch->n;
+    }
+  } else if (p->spill_write_off == 0) {
+    /*
+     * Pipe was purged or removed while the messages were written, they
+     * are lost and the file recreated by this write is removed. Nobody
+     * else could spill meanwhile.
+     */
+    unlink(path);
+  }
+
+  /* senders wait for end of writing to spill file */
+  ora_cv_broadcast(&directory->space_cv);
+  unlock_pipe(p);
+
+  batch->n = 0;
+
+  if (action != NULL) {
+    errno = save_errno;
+    spill_file_error(action, path);
+  }
+} /* write_spilled_messages() */
 
 /* ------------------------------------------------------------------------- */
 
-Datum
-dbms_pipe_unpack_message_record (
-  PG_FUNCTION_ARGS
+/*
+ * Reads messages reserved by copy_first to messages and removes them from
+ * spill file, expired messages are skipped. Caller doesn't hold any lock.
+ * Messages read from spill file of pipe purged meanwhile are lost. Returns
+ * number of read messages.
+ */
+static int
+read_spilled_messages (
+  spill_read      *reading,
+  message_buffer **messages,
+  MemoryContext    mcxt
 ) {
-  return (dbms_pipe_unpack_message(fcinfo, IT_RECORD));
-} /* dbms_pipe_unpack_message_record() */
+  char path[MAXPGPATH];
+  const char *action = NULL;
+  int save_errno = 0;
+  int32 size = 0;
+  off_t off = reading->off;
+  int nread = 0;
+  int expired = 0;
+  int64 bytes = 0;
+  int result = 0;
+  pipe *p;
+  int fd;
+  int i;
 
-/* ------------------------------------------------------------------------- */
+  if (reading->pipe_nth < 0) {
+    return (0);
+  }
 
-#define WATCH_PRE(t, et, c)                                                   \
-  et = GetNowFloat() + (float8) t; c = 0;                                     \
-  do {
+  p = &pipes[reading->pipe_nth];
+  spill_file_path(p, path);
 
-#define WATCH_POST(t, et, c)                                                  \
-    if (GetNowFloat() >= et) {                                                \
-      break;                                                                  \
-    }                                                                         \
-    if (0 == (cycle++ % 100)) {                                               \
-      CHECK_FOR_INTERRUPTS();                                                 \
-    }                                                                         \
-    pg_usleep(10000L);                                                        \
-  } while (0 != t)
+  /* reservation is returned, when reading fails by error */
+  PG_TRY();
+  {
+    if ((fd = open_spill_file(path, O_RDONLY)) < 0) {
+      action = "open";
+      save_errno = errno;
+    } else {
+      while ((off < reading->end) && (result < reading->max_count)) {
+        message_buffer *msg;
+        TimestampTz expires;
+
+        errno = 0;
+        if ((pread(fd, &size, sizeof(int32), off) != sizeof(int32)) ||
+          (pread(fd, &expires, sizeof(TimestampTz), off + sizeof(int32)) !=
+          sizeof(TimestampTz))) {
+          action = "read";
+          save_errno = errno != 0 ? errno : EIO;
+          break;
+        }
 
-Datum
-dbms_pipe_receive_message (
-  PG_FUNCTION_ARGS
-) {
-  text *pipe_name = NULL;
-  int timeout = ONE_YEAR;
-  int cycle = 0;
-  float8 endtime;
-  bool found = false;
+        /* message must be in written part of file */
+        if ((size < (int32) sizeof(message_buffer)) ||
+          (off + spill_record_size(size) > reading->end)) {
+          action = "";
+          break;
+        }
 
-  if (PG_ARGISNULL(0)) {
-    ereport(ERROR,
-      (errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
-      errmsg("pipe name is NULL"),
-      errdetail("Pipename may not be NULL.")));
+        msg = (message_buffer *) MemoryContextAlloc(mcxt, size);
+        errno = 0;
+        if (pread(fd, msg, size, off + sizeof(int32) + sizeof(TimestampTz)) !=
+          size) {
+          pfree(msg);
+          action = "read";
+          save_errno = errno != 0 ? errno : EIO;
+          break;
+        }
+        input_bytes_copied += size;
+
+        off += spill_record_size(size);
+        nread += 1;
+
+        if ((expires != 0) && (expires <= GetCurrentTimestamp())) {
+          expired += 1;
+          pfree(msg);
+        } else {
+          bytes += size;
+          messages[result++] = msg;
+        }
+      }
+
+      CloseTransientFile(fd);
+    }
+  }
+  PG_CATCH();
+  {
+    LWLockAcquire(directory_lockid, LW_SHARED);
+    LWLockAcquire(pipe_lockid(p), LW_EXCLUSIVE);
+    p->spill_reading = false;
+    notify_receivers(p);
+    unlock_pipe(p);
+
+    reading->pipe_nth = -1;
+
+    PG_RE_THROW();
+  }
+  PG_END_TRY();
+
+  LWLockAcquire(directory_lockid, LW_SHARED);
+  LWLockAcquire(pipe_lockid(p), LW_EXCLUSIVE);
+
+  Assert(p->spill_reading);
+  p->spill_reading = false;
+
+  if (p->is_valid && (p->spill_gen == reading->gen) && (action == NULL)) {
+    p->spill_read_off = off;
+    p->spill_count -= nread;
+    p->count -= nread;
+    p->stats.received += result;
+    p->stats.bytes_received += bytes;
+    p->stats.expired += expired;
+
+    /* file is kept, when somebody writes to it */
+    if ((p->spill_count == 0) && !p->spill_writing) {
+      remove_spill_file(p);
+    }
+
+    ora_cv_broadcast(&directory->space_cv);
   } else {
-    pipe_name = PG_GETARG_TEXT_P(0);
+    for (i = 0; i < result; i++) {
+      pfree(messages[i]);
+    }
+    result = 0;
   }
 
-  if (!PG_ARGISNULL(1)) {
-    timeout = PG_GETARG_INT32(1);
+  /* receivers wait for end of reading */
+  notify_receivers(p);
+  unlock_pipe(p);
+
+  reading->pipe_nth = -1;
+
+  if (action != NULL) {
+    if (*action == '\0') {
+      ereport(ERROR,
+        (errcode(ERRCODE_DATA_CORRUPTED),
+        errmsg("invalid message length %d in spill file \"%s\"",
+        size, path)));
+    }
+
+    errno = save_errno;
+    spill_file_error(action, path);
+  }
+
+  return (result);
+} /* read_spilled_messages() */
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Appends copy of message to pipe - to shared memory, or reserves it in
+ * spill file, when the pipe uses it. Reserved messages are written by
+ * write_spilled_messages after caller releases locks. Message expires
+ * after ttl seconds, zero ttl uses ttl of pipe. Returns false, when the
+ * pipe is full or there is not enough shared memory, even after expired
+ * messages are removed, or when other backend writes to spill file.
+ */
+static bool
+store_message (
+  pipe           *p,
+  message_buffer *msg,
+  int             ttl,
+  spill_batch    *batch
+) {
+  message_buffer *sh_ptr;
+  TimestampTz expires = 0;
+
+  if (ttl == 0) {
+    ttl = p->ttl;
+  }
+  if (ttl > 0) {
+    expires = TimestampTzPlusMilliseconds(GetCurrentTimestamp(),
+        (int64) ttl * 1000);
   }
 
-  if (input_buffer != NULL) {
-    pfree(input_buffer);
-    input_buffer = NULL;
+  if ((p->count >= p->limit) && (p->limit != -1)) {
+    remove_expired(p, true);
+    if (p->count >= p->limit) {
+      return (false);
+    }
   }
 
-  WATCH_PRE(timeout, endtime, cycle);
-  if (NULL != (input_buffer = get_from_pipe(pipe_name, &found))) {
-    input_buffer->next = message_buffer_get_content(input_buffer);
-    break;
+  /* spilled messages are before new messages */
+  if ((p->spill_count == 0) && !p->spill_writing &&
+    ((p->spill_threshold == 0) ||
+    (p->size + msg->size <= p->spill_threshold))) {
+    if (NULL == (sh_ptr = ora_salloc(msg->size))) {
+      remove_expired_everywhere(p);
+      sh_ptr = ora_salloc(msg->size);
+    }
+
+    if (sh_ptr != NULL) {
+      memcpy(sh_ptr, msg, msg->size);
+      if (new_last(p, sh_ptr, expires)) {
+        return (true);
+      }
+      ora_sfree(sh_ptr);
+    }
   }
-/* found empty message */
-  if (found) {
-    break;
+
+  if ((p->spill_threshold > 0) || (p->spill_count > 0) ||
+    p->spill_writing) {
+    return (reserve_spill(p, msg, expires, batch));
+  }
+
+  return (false);
+} /* store_message() */
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Returns local copy of first message of pipe. Message of fan-out pipe
+ * is next unread message of this session, it is released from shared
+ * memory when all subscribers have read it. Caller checked the session
+ * is subscriber of fan-out pipe. Spilled messages are only reserved to
+ * reading, caller reads them by read_spilled_messages after it releases
+ * locks. Nothing is found, while other backend reads them.
+ */
+static message_buffer *
+copy_first (
+  pipe         *p,
+  bool         *found,
+  MemoryContext mcxt,
+  spill_read   *reading
+) {
+  message_buffer *shm_msg = NULL;
+  message_buffer *result = NULL;
+
+  remove_expired(p, false);
+
+  if (p->fanout) {
+    subscriber *s = find_subscriber(p);
+    queue_item *q;
+
+    Assert(s != NULL);
+
+    /* expired items, that are not at head of queue, are skipped */
+    while ((NULL != (q = s->cursor)) && (q->expires != 0) &&
+      (q->expires <= GetCurrentTimestamp())) {
+      s->cursor = q->next_item;
+      q->refs -= 1;
+    }
+
+    *found = false;
+    if (NULL != (q = s->cursor)) {
+      s->cursor = q->next_item;
+      q->refs -= 1;
+      *found = true;
+
+      p->stats.received += 1;
+      if (NULL != (shm_msg = q->ptr)) {
+        p->stats.bytes_received += shm_msg->size;
+
+        result = (message_buffer *) MemoryContextAlloc(mcxt, shm_msg->size);
+        memcpy(result, shm_msg, shm_msg->size);
+        input_bytes_copied += shm_msg->size;
+      }
+
+      free_read_items(p);
+    }
+  } else if ((p->items == NULL) && (p->spill_count > 0)) {
+    *found = false;
+    if (!p->spill_reading) {
+      p->spill_reading = true;
+      reading->pipe_nth = p - pipes;
+      reading->gen = p->spill_gen;
+      reading->off = p->spill_read_off;
+      reading->end = p->spill_ready_off;
+    }
+  } else if (NULL != (shm_msg = remove_first(p, found))) {
+    p->size -= shm_msg->size;
+
+    result = (message_buffer *) MemoryContextAlloc(mcxt, shm_msg->size);
+    memcpy(result, shm_msg, shm_msg->size);
+    input_bytes_copied += shm_msg->size;
+    ora_sfree(shm_msg);
+
+    ora_cv_broadcast(&directory->space_cv);
+  }
+
+  return (result);
+} /* copy_first() */
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Adds time spent by waiting for pipe to its statistics. Nothing is
+ * counted when the pipe doesn't exist.
+ */
+static void
+count_wait (
+  text  *pipe_name,
+  float8 start,
+  bool   is_send,
+  bool   timed_out
+) {
+  pipe *p;
+  bool created;
+
+  if (NULL != (p = lock_pipe(pipe_name, &created, true))) {
+    p->stats.wait_time += (int64) ((GetNowFloat() - start) * 1000000.0);
+
+    if (timed_out) {
+      if (is_send) {
+        p->stats.send_timeouts += 1;
+      } else {
+        p->stats.receive_timeouts += 1;
+      }
+    }
+
+    unlock_pipe(p);
+  }
+} /* count_wait() */
+
+/* ------------------------------------------------------------------------- */
+
+/* copy message to local memory, if exists */
+
+static message_buffer *
+get_from_pipe (
+  text         *pipe_name,
+  bool         *found,
+  MemoryContext mcxt
+) {
+  pipe *p;
+  bool created;
+  bool is_empty = false;
+  message_buffer *result = NULL;
+  spill_read reading;
+
+  if (!ora_attach_shmem(SHMEMMSGSZ, MAX_PIPES, MAX_EVENTS, MAX_LOCKS)) {
+    return (NULL);
+  }
+
+  reading.pipe_nth = -1;
+  reading.max_count = 1;
+
+  if (NULL != (p = lock_pipe(pipe_name, &created, false))) {
+    if (!created) {
+      if (p->fanout && (find_subscriber(p) == NULL)) {
+        unlock_pipe(p);
+        not_subscribed_error();
+      }
+
+      result = copy_first(p, found, mcxt, &reading);
+
+      /* implicit pipe can be empty after its messages expired */
+      is_empty = (p->items == NULL) && !p->registered;
+    }
+
+    unlock_pipe(p);
+  }
+
+  if (is_empty) {
+    release_empty_pipe(pipe_name);
+  }
+
+  if (read_spilled_messages(&reading, &result, mcxt) > 0) {
+    *found = true;
+  }
+
+  return (decompress_message(result, mcxt));
+} /* get_from_pipe() */
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * State of pipes seen by last get_from_pipes, which receive_any checks
+ * without locks, when it is woken. Slot is -1 for missing pipe.
+ */
+typedef struct {
+  uint32  pipes_version;
+  int    *slots;
+  uint32 *versions;
+} pipes_scan;
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Takes first message of first nonempty pipe from list. All pipes are
+ * checked under one shared lock of directory, searching starts at
+ * *nth, so no pipe of list is preferred. Returns index of pipe, which
+ * message was taken, or -1. The seen pipes are stored to scan.
+ */
+static int
+get_from_pipes (
+  text           **pipe_names,
+  int              n,
+  int              nth,
+  message_buffer **message,
+  MemoryContext    mcxt,
+  pipes_scan      *scan
+) {
+  int i;
+  int result = -1;
+  int reserved = -1;
+  bool is_empty = false;
+  spill_read reading;
+
+  *message = NULL;
+
+  if (!ora_attach_shmem(SHMEMMSGSZ, MAX_PIPES, MAX_EVENTS, MAX_LOCKS)) {
+    return (-1);
+  }
+
+  reading.pipe_nth = -1;
+  reading.max_count = 1;
+
+  LWLockAcquire(directory_lockid, LW_SHARED);
+
+  scan->pipes_version = directory->pipes_version;
+  for (i = 0; i < n; i++) {
+    scan->slots[i] = -1;
+  }
+
+  for (i = 0; (i < n) && (result == -1) && (reserved == -1); i++) {
+    int k = (nth + i) % n;
+    pipe *p;
+    bool created;
+    bool found;
+
+    if (NULL == (p = find_pipe(pipe_names[k], &created, true))) {
+      continue;
+    }
+
+    LWLockAcquire(pipe_lockid(p), LW_EXCLUSIVE);
+
+    scan->slots[k] = (int) (p - pipes);
+    scan->versions[k] = p->data_version;
+
+    if (p->fanout && (find_subscriber(p) == NULL)) {
+      unlock_pipe(p);
+      not_subscribed_error();
+    }
+
+    *message = copy_first(p, &found, mcxt, &reading);
+
+    if (found) {
+      is_empty = (p->items == NULL) && !p->registered;
+      result = k;
+    } else if (reading.pipe_nth != -1) {
+      reserved = k;
+    }
+
+    LWLockRelease(pipe_lockid(p));
+  }
+
+  LWLockRelease(directory_lockid);
+
+  if (is_empty) {
+    release_empty_pipe(pipe_names[result]);
+  }
+
+  /* all pipes are scanned again, when no spilled message was read */
+  if (read_spilled_messages(&reading, message, mcxt) > 0) {
+    result = reserved;
+  }
+
+  *message = decompress_message(*message, mcxt);
+
+  return (result);
+} /* get_from_pipes() */
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Returns true, when some pipe was created or some message was sent to
+ * seen pipe since last get_from_pipes. Shared memory is read without
+ * locks, a stale value only causes one more scan, because the versions
+ * are changed before data_cv is signaled.
+ */
+static bool
+pipes_changed (
+  pipes_scan *scan,
+  int         n
+) {
+  int i;
+
+  if (directory == NULL) {
+    return (true);
+  }
+
+  if (((volatile pipe_directory *) directory)->pipes_version !=
+    scan->pipes_version) {
+    return (true);
+  }
+
+  for (i = 0; i < n; i++) {
+    if ((scan->slots[i] >= 0) &&
+      (((volatile pipe *) &pipes[scan->slots[i]])->data_version !=
+      scan->versions[i])) {
+      return (true);
+    }
+  }
+
+  return (false);
+} /* pipes_changed() */
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * if ptr is null, then only register pipe
+ */
+static bool
+add_to_pipe (
+  text           *pipe_name,
+  message_buffer *ptr,
+  int             limit,
+  bool            limit_is_valid,
+  int             ttl
+) {
+  pipe *p;
+  bool created;
+  bool result = false;
+  spill_batch batch = { 0 };
+
+  if (!ora_attach_shmem(SHMEMMSGSZ, MAX_PIPES, MAX_EVENTS, MAX_LOCKS)) {
+    return (false);
+  }
+
+  if (NULL != (p = lock_pipe(pipe_name, &created, false))) {
+    if (created) {
+      p->registered = ptr == NULL;
+    }
+
+    if (limit_is_valid && (created || (p->limit < limit))) {
+      p->limit = limit;
+    }
+
+    if (ptr == NULL) {
+      result = true;
+    } else if (store_message(p, ptr, ttl, &batch)) {
+      result = true;
+      notify_receivers(p);
+    } else if (created) {
+      /* I created new pipe, but haven't memory for new value */
+      LWLockRelease(pipe_lockid(p));
+      release_pipe(p);
+      LWLockRelease(directory_lockid);
+      return (false);
+    }
+
+    unlock_pipe(p);
+    write_spilled_messages(&batch);
+  }
+
+  return (result);
+} /* add_to_pipe() */
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Append messages to pipe under one lock. Returns number of appended
+ * messages, it is less than n, when the pipe is full or there is not
+ * enough shared memory.
+ */
+static int
+add_messages_to_pipe (
+  text            *pipe_name,
+  message_buffer **messages,
+  int              n,
+  int              limit,
+  bool             limit_is_valid,
+  int              ttl
+) {
+  pipe *p;
+  bool created;
+  int result = 0;
+  spill_batch batch = { 0 };
+
+  if (!ora_attach_shmem(SHMEMMSGSZ, MAX_PIPES, MAX_EVENTS, MAX_LOCKS)) {
+    return (0);
+  }
+
+  if (NULL != (p = lock_pipe(pipe_name, &created, false))) {
+    if (limit_is_valid && (created || (p->limit < limit))) {
+      p->limit = limit;
+    }
+
+    while ((result < n) &&
+      store_message(p, messages[result], ttl, &batch)) {
+      result += 1;
+    }
+
+    if (result > 0) {
+      notify_receivers(p);
+    } else if (created) {
+      /* I created new pipe, but haven't memory for any value */
+      LWLockRelease(pipe_lockid(p));
+      release_pipe(p);
+      LWLockRelease(directory_lockid);
+      return (0);
+    }
+
+    unlock_pipe(p);
+    write_spilled_messages(&batch);
+  }
+
+  return (result);
+} /* add_messages_to_pipe() */
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Take at most max_count messages from pipe under one lock. Local copies
+ * of messages are stored to *messages array allocated in current memory
+ * context. Returns number of messages.
+ */
+static int
+get_messages_from_pipe (
+  text             *pipe_name,
+  int               max_count,
+  message_buffer ***messages
+) {
+  pipe *p;
+  bool created;
+  bool is_empty = false;
+  int result = 0;
+  int size = 0;
+  int i;
+  spill_read reading;
+
+  *messages = NULL;
+
+  if (!ora_attach_shmem(SHMEMMSGSZ, MAX_PIPES, MAX_EVENTS, MAX_LOCKS)) {
+    return (0);
+  }
+
+  reading.pipe_nth = -1;
+
+  if (NULL != (p = lock_pipe(pipe_name, &created, true))) {
+    if (p->fanout && (find_subscriber(p) == NULL)) {
+      unlock_pipe(p);
+      not_subscribed_error();
+    }
+
+    while (result < max_count) {
+      message_buffer *msg;
+      bool found;
+
+      /* empty message is stored as NULL */
+      reading.max_count = max_count - result;
+      msg = copy_first(p, &found, CurrentMemoryContext, &reading);
+      if (!found) {
+        break;
+      }
+
+      if (result >= size) {
+        size = size > 0 ? size * 2 : 16;
+        *messages = *messages != NULL ?
+          repalloc(*messages, size * sizeof(message_buffer *)) :
+          palloc(size * sizeof(message_buffer *));
+      }
+
+      (*messages)[result] = msg;
+      result += 1;
+    }
+
+    if (result > 0) {
+      is_empty = (p->items == NULL) && !p->registered;
+    }
+
+    unlock_pipe(p);
+  }
+
+  if (is_empty) {
+    release_empty_pipe(pipe_name);
+  }
+
+  /* spilled messages follow messages taken from shared memory */
+  if (reading.pipe_nth != -1) {
+    if (result + reading.max_count > size) {
+      size = result + reading.max_count;
+      *messages = *messages != NULL ?
+        repalloc(*messages, size * sizeof(message_buffer *)) :
+        palloc(size * sizeof(message_buffer *));
+    }
+
+    result += read_spilled_messages(&reading, *messages + result,
+        CurrentMemoryContext);
+  }
+
+  for (i = 0; i < result; i++) {
+    (*messages)[i] = decompress_message((*messages)[i], CurrentMemoryContext);
+  }
+
+  return (result);
+} /* get_messages_from_pipe() */
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Caller holds exclusive lock of pipe directory, so nobody can use the pipe.
+ */
+static void
+remove_pipe (
+  text *pipe_name,
+  bool  purge
+) {
+  pipe *p;
+  bool created;
+  int i;
+
+  if (NULL != (p = find_pipe(pipe_name, &created, true))) {
+    queue_item *q = p->items;
+    while (q != NULL) {
+      queue_item *aux_q;
+
+      aux_q = q->next_item;
+      if (q->ptr) {
+        ora_sfree(q->ptr);
+      }
+      ora_sfree(q);
+      q = aux_q;
+    }
+    p->items = NULL;
+    p->last_item = NULL;
+    p->size = 0;
+    p->count = 0;
+    p->expiring = 0;
+    for (i = 0; i < p->nsubscribers; i++) {
+      p->subscribers[i].cursor = NULL;
+    }
+    remove_spill_file(p);
+    ora_cv_broadcast(&directory->space_cv);
+    if (!(purge && p->registered)) {
+      release_pipe(p);
+    }
+  }
+} /* remove_pipe() */
+
+/* ------------------------------------------------------------------------- */
+
+Datum
+dbms_pipe_next_item_type (
+  PG_FUNCTION_ARGS
+) {
+  PG_RETURN_INT32(
+    input_buffer != NULL ? input_buffer->next->type : IT_NO_MORE_ITEMS);
+} /* dbms_pipe_next_item_type() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+init_buffer (
+  message_buffer *buffer,
+  int32           size
+) {
+  memset(buffer, 0, message_buffer_size);
+  buffer->size = message_buffer_size;
+  buffer->items_count = 0;
+  buffer->next = message_buffer_get_content(buffer);
+} /* init_buffer() */
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Returns empty context for received message
+ */
+static MemoryContext
+get_input_context (
+  void
+) {
+  if (input_context == NULL) {
+    input_context = AllocSetContextCreate(TopMemoryContext,
+      "orafce pipe message",
+      ALLOCSET_SMALL_MINSIZE,
+      ALLOCSET_SMALL_INITSIZE,
+      ALLOCSET_SMALL_MAXSIZE);
+  }
+
+  return (input_context);
+} /* get_input_context() */
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Forgets received message. When no unpacked value points into it,
+ * the memory is reused for next message.
+ */
+static void
+release_input_buffer (
+  void
+) {
+  if (input_buffer == NULL) {
+    return;
+  }
+
+  if ((input_refs != NULL) && (input_refs->refs > 0)) {
+#if PG_VERSION_NUM >= 90500
+    input_refs->released = true;
+#else
+    /*
+     * Without reset callbacks the message lives to end of transaction,
+     * values cannot be held longer before procedures with COMMIT.
+     */
+    MemoryContextSetParent(input_context, TopTransactionContext);
+#endif
+    input_context = NULL;
+  } else {
+    MemoryContextReset(input_context);
+  }
+
+  input_buffer = NULL;
+  input_refs = NULL;
+} /* release_input_buffer() */
+
+/* ------------------------------------------------------------------------- */
+
+#if PG_VERSION_NUM >= 90500
+/*
+ * Reset callback of context, which got unpacked value. Released message
+ * is deleted with its last reference.
+ */
+static void
+release_input_message_ref (
+  void *arg
+) {
+  input_message_ref *ref = (input_message_ref *) arg;
+  input_message_refs *refs = ref->refs;
+
+  if (refs->last_owner == ref->owner) {
+    refs->last_owner = NULL;
+  }
+
+  if ((--refs->refs == 0) && refs->released) {
+    MemoryContextDelete(refs->context);
+  }
+} /* release_input_message_ref() */
+#endif
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Returns varlena value placed in received message, current memory
+ * context holds the message. Its header is written to vl_len, which
+ * precedes the data.
+ */
+static Datum
+input_varlena (
+  char  *ptr,
+  int32 size
+) {
+  struct varlena *result = (struct varlena *) (ptr - VARHDRSZ);
+
+  if (input_refs == NULL) {
+    input_refs = (input_message_refs *)
+      MemoryContextAllocZero(input_context, sizeof(input_message_refs));
+    input_refs->context = input_context;
+  }
+
+  if (input_refs->last_owner != CurrentMemoryContext) {
+#if PG_VERSION_NUM >= 90500
+    input_message_ref *ref;
+
+    ref = (input_message_ref *) palloc(sizeof(input_message_ref));
+    ref->refs = input_refs;
+    ref->owner = CurrentMemoryContext;
+    ref->callback.func = release_input_message_ref;
+    ref->callback.arg = ref;
+    MemoryContextRegisterResetCallback(CurrentMemoryContext, &ref->callback);
+#endif
+
+    input_refs->last_owner = CurrentMemoryContext;
+    input_refs->refs += 1;
+  }
+
+  SET_VARSIZE(result, size + VARHDRSZ);
+
+  return (PointerGetDatum(result));
+} /* input_varlena() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+check_message_size (
+  Size size
+) {
+  if (size > MAXMSGSZ) {
+    ereport(ERROR,
+      (errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+      errmsg("message is too big"),
+      errdetail("Packed message would have %zu bytes, the limit is %zu bytes.",
+        size, MAXMSGSZ),
+      errhint("Increase orafce.pipe_max_message_size.")));
+  }
+} /* check_message_size() */
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Returns the output buffer with space for one more field of given size.
+ * The buffer starts small and doubles, so a message of few short fields
+ * does not cost LOCALMSGSZ bytes and a large message is not limited by it.
+ */
+static message_buffer *
+check_buffer (
+  message_buffer *buffer,
+  int32           size
+) {
+  Size need;
+  Size capacity;
+
+  if (buffer == NULL) {
+    output_buffer_capacity = 0;
+    need = message_buffer_size;
+  } else {
+    need = buffer->size;
+  }
+
+  if (size > 0) {
+    need += message_data_item_size + MAXALIGN(size);
+  }
+
+  check_message_size(need);
+
+  if (need <= output_buffer_capacity) {
+    return (buffer);
+  }
+
+  capacity = output_buffer_capacity > 0 ? output_buffer_capacity : 1024;
+  while (capacity < need) {
+    capacity *= 2;
+  }
+
+  capacity = Min(capacity, MAXMSGSZ);
+
+  if (buffer == NULL) {
+    buffer = (message_buffer *) MemoryContextAlloc(TopMemoryContext,
+      capacity);
+    init_buffer(buffer, capacity);
+  } else {
+    buffer = (message_buffer *) repalloc(buffer, capacity);
+    buffer->next = (message_data_item *) ((char *) buffer + buffer->size);
+  }
+
+  output_buffer_capacity = (int32) capacity;
+
+  return (buffer);
+} /* check_buffer() */
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Releases the sent output buffer, a small one is kept for next message
+ */
+static void
+reset_output_buffer (
+  void
+) {
+  output_ttl = 0;
+
+  if (output_buffer == NULL) {
+    return;
+  }
+
+  if (output_buffer_capacity > LOCALMSGSZ) {
+    pfree(output_buffer);
+    output_buffer = NULL;
+    output_buffer_capacity = 0;
+  } else {
+    init_buffer(output_buffer, output_buffer_capacity);
+  }
+} /* reset_output_buffer() */
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Returns new message with one field, used by batch send
+ */
+static message_buffer *
+single_field_message (
+  message_data_type type,
+  int32             size,
+  void             *ptr,
+  Oid               tupType
+) {
+  int32 len = message_buffer_size + message_data_item_size + MAXALIGN(size);
+  message_buffer *buffer;
+
+  check_message_size(len);
+
+  buffer = (message_buffer *) palloc(len);
+  init_buffer(buffer, len);
+  pack_field(buffer, type, size, ptr, tupType);
+
+  return (buffer);
+} /* single_field_message() */
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Pack value to message like pack_message does. Values of types, that
+ * pack_message doesn't know, are packed as text.
+ */
+static message_buffer *
+value_message (
+  Datum value,
+  Oid   typid
+) {
+  DateADT dt;
+  TimestampTz ts;
+
+  switch (typid) {
+    case INT2OID:
+      value = DirectFunctionCall1(int2_numeric, value);
+      typid = NUMERICOID;
+      break;
+
+    case INT4OID:
+      value = DirectFunctionCall1(int4_numeric, value);
+      typid = NUMERICOID;
+      break;
+
+    case INT8OID:
+      value = DirectFunctionCall1(int8_numeric, value);
+      typid = NUMERICOID;
+      break;
+
+    case TIMESTAMPOID:
+      value = DirectFunctionCall1(timestamp_timestamptz, value);
+      typid = TIMESTAMPTZOID;
+      break;
+  }
+
+  switch (typid) {
+    case TEXTOID:
+    case VARCHAROID:
+    case BPCHAROID:
+      {
+        text *str = DatumGetTextPP(value);
+
+        return (single_field_message(IT_VARCHAR,
+          VARSIZE_ANY_EXHDR(str), VARDATA_ANY(str), InvalidOid));
+      }
+
+    case NUMERICOID:
+      {
+        Numeric num = DatumGetNumeric(value);
+
+        return (single_field_message(IT_NUMBER,
+          VARSIZE(num) - VARHDRSZ, VARDATA(num), InvalidOid));
+      }
+
+    case BYTEAOID:
+      {
+        bytea *data = DatumGetByteaPP(value);
+
+        return (single_field_message(IT_BYTEA,
+          VARSIZE_ANY_EXHDR(data), VARDATA_ANY(data), InvalidOid));
+      }
+
+    case DATEOID:
+      dt = DatumGetDateADT(value);
+      return (single_field_message(IT_DATE, sizeof(dt), &dt, InvalidOid));
+
+    case TIMESTAMPTZOID:
+      ts = DatumGetTimestampTz(value);
+      return (single_field_message(IT_TIMESTAMPTZ, sizeof(ts), &ts,
+        InvalidOid));
+  }
+
+  if (type_is_rowtype(typid)) {
+    Oid typsend;
+    bool isvarlena;
+    bytea *data;
+
+    /*  We can serialize only typed record */
+    if (typid == RECORDOID) {
+      typid = HeapTupleHeaderGetTypeId(DatumGetHeapTupleHeader(value));
+      if (typid == RECORDOID) {
+        ereport(ERROR,
+          (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+          errmsg("anonymous record cannot be sent to pipe"),
+          errhint("Use composite type.")));
+      }
+    }
+
+    getTypeBinaryOutputInfo(typid, &typsend, &isvarlena);
+    data = OidSendFunctionCall(typsend, value);
+
+    return (single_field_message(IT_RECORD,
+      VARSIZE(data) - VARHDRSZ, VARDATA(data), typid));
+  } else {
+    Oid typoutput;
+    bool isvarlena;
+    char *str;
+
+    getTypeOutputInfo(typid, &typoutput, &isvarlena);
+    str = OidOutputFunctionCall(typoutput, value);
+
+    return (single_field_message(IT_VARCHAR, strlen(str), str, InvalidOid));
+  }
+} /* value_message() */
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Binary I/O functions of types are looked up once per session. Entry is
+ * marked invalid, when its type or relation of composite type is changed,
+ * and it is looked up again by next use. FmgrInfo of a function can be
+ * used by caller, so the old data are kept in context of the cache, which
+ * is rebuilt by next lookup, when there are too many of them.
+ *
+ * The FmgrInfo lives as long as the cache, so record_send and record_recv
+ * keep their column I/O data and tuple descriptor in fn_extra between
+ * calls.
+ */
+typedef struct {
+  Oid   typid;
+  int32 typmod;
+} type_io_key;
+
+typedef struct {
+  type_io_key key;          /* hash key, must be first */
+  bool        is_valid;
+  uint32      hashvalue;    /* hash value of type in syscache */
+  Oid         typrelid;     /* relation of composite type */
+  Oid         typioparam;
+  FmgrInfo    send_finfo;
+  FmgrInfo    recv_finfo;
+} type_io_entry;
+
+#define TYPE_IO_MAX_STALE    64
+
+static HTAB *type_io_cache = NULL;
+static MemoryContext type_io_context = NULL;
+static int type_io_stale = 0;  /* entries looked up again */
+
+static void
+invalidate_type_io_cache (
+  Datum  arg,
+  int    cacheid,
+  uint32 hashvalue
+) {
+  HASH_SEQ_STATUS status;
+  type_io_entry *entry;
+
+  if (type_io_cache == NULL) {
+    return;
+  }
+
+  /* zero hash value is reset of cache */
+  hash_seq_init(&status, type_io_cache);
+  while (NULL != (entry = (type_io_entry *) hash_seq_search(&status))) {
+    if ((hashvalue == 0) || (entry->hashvalue == hashvalue)) {
+      entry->is_valid = false;
+    }
+  }
+} /* invalidate_type_io_cache() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+invalidate_type_io_cache_rel (
+  Datum arg,
+  Oid   relid
+) {
+  HASH_SEQ_STATUS status;
+  type_io_entry *entry;
+
+  if (type_io_cache == NULL) {
+    return;
+  }
+
+  /* InvalidOid is reset of cache */
+  hash_seq_init(&status, type_io_cache);
+  while (NULL != (entry = (type_io_entry *) hash_seq_search(&status))) {
+    if ((relid == InvalidOid) || (entry->typrelid == relid)) {
+      entry->is_valid = false;
+    }
+  }
+} /* invalidate_type_io_cache_rel() */
+
+/* ------------------------------------------------------------------------- */
+
+static type_io_entry *
+get_type_io (
+  Oid   typid,
+  int32 typmod
+) {
+  static bool callbacks_registered = false;
+
+  type_io_key key;
+  type_io_entry *entry;
+  bool found;
+
+  if (!callbacks_registered) {
+    CacheRegisterSyscacheCallback(TYPEOID, invalidate_type_io_cache,
+      (Datum) 0);
+    CacheRegisterRelcacheCallback(invalidate_type_io_cache_rel, (Datum) 0);
+    callbacks_registered = true;
+  }
+
+  if ((type_io_cache == NULL) || (type_io_stale > TYPE_IO_MAX_STALE)) {
+    HASHCTL ctl;
+
+    if (type_io_context != NULL) {
+      MemoryContextDelete(type_io_context);
+    }
+
+    type_io_context = AllocSetContextCreate(TopMemoryContext,
+      "orafce pipe type I/O",
+      ALLOCSET_SMALL_MINSIZE,
+      ALLOCSET_SMALL_INITSIZE,
+      ALLOCSET_SMALL_MAXSIZE);
+
+    memset(&ctl, 0, sizeof(ctl));
+    ctl.keysize = sizeof(type_io_key);
+    ctl.entrysize = sizeof(type_io_entry);
+    ctl.hcxt = type_io_context;
+#if PG_VERSION_NUM >= 90500
+    type_io_cache = hash_create("orafce pipe type I/O", 16, &ctl,
+        HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+#else
+    ctl.hash = tag_hash;
+    type_io_cache = hash_create("orafce pipe type I/O", 16, &ctl,
+        HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
+#endif
+
+    type_io_stale = 0;
+  }
+
+  memset(&key, 0, sizeof(key));
+  key.typid = typid;
+  key.typmod = typmod;
+
+  entry = (type_io_entry *) hash_search(type_io_cache, &key, HASH_ENTER,
+      &found);
+  if (found && !entry->is_valid) {
+    type_io_stale += 1;
+    found = false;
+  }
+
+  if (!found) {
+    Oid typsend;
+    Oid typreceive;
+    bool isvarlena;
+
+    /* entry is valid, when all its fields are set */
+    entry->is_valid = false;
+
+    PG_TRY();
+    {
+      getTypeBinaryOutputInfo(typid, &typsend, &isvarlena);
+      getTypeBinaryInputInfo(typid, &typreceive, &entry->typioparam);
+      entry->typrelid = get_typ_typrelid(typid);
+    }
+    PG_CATCH();
+    {
+      hash_search(type_io_cache, &key, HASH_REMOVE, NULL);
+      PG_RE_THROW();
+    }
+    PG_END_TRY();
+
+    fmgr_info_cxt(typsend, &entry->send_finfo, type_io_context);
+    fmgr_info_cxt(typreceive, &entry->recv_finfo, type_io_context);
+
+    entry->hashvalue = GetSysCacheHashValue1(TYPEOID,
+      ObjectIdGetDatum(typid));
+    entry->is_valid = true;
+  }
+
+  return (entry);
+} /* get_type_io() */
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Prepares buffer for receive function. Receive functions of some types
+ * (record) temporary write terminating zero behind the read data, so the
+ * data are used in place only when the field has padding bytes.
+ */
+static void
+field_to_stringinfo (
+  StringInfo buf,
+  void      *ptr,
+  int32      size
+) {
+  if (MAXALIGN(size) > size) {
+    buf->data = ptr;
+    buf->len = size;
+    buf->maxlen = size + 1;
+    buf->cursor = 0;
+  } else {
+    initStringInfo(buf);
+    appendBinaryStringInfo(buf, ptr, size);
+  }
+} /* field_to_stringinfo() */
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Returns text representation of message field
+ */
+static text *
+field_to_text (
+  message_data_type type,
+  void             *ptr,
+  int32             size,
+  Oid               tupType
+) {
+  Datum value;
+  Oid typid;
+  Oid typoutput;
+  bool isvarlena;
+
+  switch (type) {
+    case IT_VARCHAR:
+      return (cstring_to_text_with_len(ptr, size));
+
+    case IT_NUMBER:
+      typid = NUMERICOID;
+      value = PointerGetDatum(cstring_to_text_with_len(ptr, size));
+      break;
+
+    case IT_BYTEA:
+      typid = BYTEAOID;
+      value = PointerGetDatum(cstring_to_text_with_len(ptr, size));
+      break;
+
+    case IT_DATE:
+      typid = DATEOID;
+      value = DateADTGetDatum(*(DateADT *) ptr);
+      break;
+
+    case IT_TIMESTAMPTZ:
+      typid = TIMESTAMPTZOID;
+      value = TimestampTzGetDatum(*(TimestampTz *) ptr);
+      break;
+
+    case IT_RECORD:
+    case IT_BINARY:
+      {
+        StringInfoData buf;
+        type_io_entry *io;
+
+        field_to_stringinfo(&buf, ptr, size);
+
+        typid = tupType;
+        io = get_type_io(typid, -1);
+        value = ReceiveFunctionCall(&io->recv_finfo, &buf, io->typioparam,
+          -1);
+        break;
+      }
+
+    default:
+      elog(ERROR, "unexpected type: %d", type);
+      return (NULL); /* keep compiler quiet */
+  }
+
+  getTypeOutputInfo(typid, &typoutput, &isvarlena);
+
+  return (cstring_to_text(OidOutputFunctionCall(typoutput, value)));
+} /* field_to_text() */
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Returns all fields of message as array of text
+ */
+static ArrayType *
+message_to_array (
+  message_buffer *buffer
+) {
+  Datum *values;
+  int n = buffer->items_count;
+  int i;
+
+  values = (Datum *) palloc(Max(n, 1) * sizeof(Datum));
+
+  buffer->next = message_buffer_get_content(buffer);
+  for (i = 0; i < n; i++) {
+    message_data_type type;
+    int32 size;
+    Oid tupType;
+    void *ptr;
+
+    ptr = unpack_field(buffer, &type, &size, &tupType);
+    values[i] = PointerGetDatum(field_to_text(type, ptr, size, tupType));
+  }
+
+  return (construct_array(values, n, TEXTOID, -1, false, 'i'));
+} /* message_to_array() */
+
+/* ------------------------------------------------------------------------- */
+
+Datum
+dbms_pipe_pack_message_text (
+  PG_FUNCTION_ARGS
+) {
+  text *str = PG_GETARG_TEXT_PP(0);
+
+  output_buffer = check_buffer(output_buffer, VARSIZE_ANY_EXHDR(str));
+  pack_field(output_buffer, IT_VARCHAR,
+    VARSIZE_ANY_EXHDR(str), VARDATA_ANY(str), InvalidOid);
+
+  PG_RETURN_VOID();
+} /* dbms_pipe_pack_message_text() */
+
+/* ------------------------------------------------------------------------- */
+
+Datum
+dbms_pipe_pack_message_date (
+  PG_FUNCTION_ARGS
+) {
+  DateADT dt = PG_GETARG_DATEADT(0);
+
+  output_buffer = check_buffer(output_buffer, sizeof(dt));
+  pack_field(output_buffer, IT_DATE,
+    sizeof(dt), &dt, InvalidOid);
+
+  PG_RETURN_VOID();
+} /* dbms_pipe_pack_message_date() */
+
+/* ------------------------------------------------------------------------- */
+
+Datum
+dbms_pipe_pack_message_timestamp (
+  PG_FUNCTION_ARGS
+) {
+  TimestampTz dt = PG_GETARG_TIMESTAMPTZ(0);
+
+  output_buffer = check_buffer(output_buffer, sizeof(dt));
+  pack_field(output_buffer, IT_TIMESTAMPTZ,
+    sizeof(dt), &dt, InvalidOid);
+
+  PG_RETURN_VOID();
+} /* dbms_pipe_pack_message_timestamp() */
+
+/* ------------------------------------------------------------------------- */
+
+Datum
+dbms_pipe_pack_message_number (
+  PG_FUNCTION_ARGS
+) {
+  Numeric num = PG_GETARG_NUMERIC(0);
+
+  output_buffer = check_buffer(output_buffer, VARSIZE(num) - VARHDRSZ);
+  pack_field(output_buffer, IT_NUMBER,
+    VARSIZE(num) - VARHDRSZ, VARDATA(num), InvalidOid);
+
+  PG_RETURN_VOID();
+} /* dbms_pipe_pack_message_number() */
+
+/* ------------------------------------------------------------------------- */
+
+Datum
+dbms_pipe_pack_message_bytea (
+  PG_FUNCTION_ARGS
+) {
+  bytea *data = PG_GETARG_BYTEA_P(0);
+
+  output_buffer = check_buffer(output_buffer, VARSIZE_ANY_EXHDR(data));
+  pack_field(output_buffer, IT_BYTEA,
+    VARSIZE_ANY_EXHDR(data), VARDATA_ANY(data), InvalidOid);
+
+  PG_RETURN_VOID();
+} /* dbms_pipe_pack_message_bytea() */
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ *  We can serialize only typed record
+ */
+Datum
+dbms_pipe_pack_message_record (
+  PG_FUNCTION_ARGS
+) {
+  HeapTupleHeader rec = PG_GETARG_HEAPTUPLEHEADER(0);
+  Oid tupType;
+  type_io_entry *io;
+  bytea *data;
+
+  tupType = HeapTupleHeaderGetTypeId(rec);
+
+  io = get_type_io(tupType, HeapTupleHeaderGetTypMod(rec));
+  data = SendFunctionCall(&io->send_finfo, PointerGetDatum(rec));
+
+  output_buffer = check_buffer(output_buffer, VARSIZE(data) - VARHDRSZ);
+  pack_field(output_buffer, IT_RECORD,
+    VARSIZE(data) - VARHDRSZ, VARDATA(data), tupType);
+
+  PG_RETURN_VOID();
+} /* dbms_pipe_pack_message_record() */
+
+/* ------------------------------------------------------------------------- */
+
+static Datum
+dbms_pipe_unpack_message (
+  PG_FUNCTION_ARGS,
+  message_data_type dtype
+) {
+  Oid tupType;
+  void *ptr;
+  message_data_type type;
+  int32 size;
+  Datum result;
+  message_data_type next_type;
+
+  if ((input_buffer == NULL) ||
+    (input_buffer->items_count <= 0) ||
+    (input_buffer->next == NULL) ||
+    (input_buffer->next->type == IT_NO_MORE_ITEMS)) {
+    PG_RETURN_NULL();
+  }
+
+  next_type = input_buffer->next->type;
+  if (next_type != dtype) {
+    ereport(ERROR,
+      (errcode(ERRCODE_DATATYPE_MISMATCH),
+      errmsg("datatype mismatch"),
+      errdetail("unpack unexpected type: %d", next_type)));
+  }
+
+  ptr = unpack_field(input_buffer, &type, &size, &tupType);
+  Assert(ptr != NULL);
+
+  switch (type)
+  {
+    case IT_TIMESTAMPTZ:
+      result = TimestampTzGetDatum(*(TimestampTz *) ptr);
+      break;
+
+    case IT_DATE:
+      result = DateADTGetDatum(*(DateADT *) ptr);
+      break;
+
+    case IT_VARCHAR:
+    case IT_NUMBER:
+    case IT_BYTEA:
+      result = input_varlena(ptr, size);
+      break;
+
+    case IT_RECORD:
+      {
+        StringInfoData buf;
+        type_io_entry *io;
+
+        field_to_stringinfo(&buf, ptr, size);
+
+        io = get_type_io(tupType, -1);
+        result = ReceiveFunctionCall(&io->recv_finfo, &buf, io->typioparam,
+          -1);
+        break;
+      }
+
+    default:
+      elog(ERROR, "unexpected type: %d", type);
+      result = (Datum) 0; /* keep compiler quiet */
+  }
+
+  if (input_buffer->items_count == 0) {
+    release_input_buffer();
+  }
+
+  PG_RETURN_DATUM(result);
+} /* dbms_pipe_unpack_message() */
+
+/* ------------------------------------------------------------------------- */
+
+Datum
+dbms_pipe_unpack_message_text (
+  PG_FUNCTION_ARGS
+) {
+  return (dbms_pipe_unpack_message(fcinfo, IT_VARCHAR));
+} /* dbms_pipe_unpack_message_text() */
+
+/* ------------------------------------------------------------------------- */
+
+Datum
+dbms_pipe_unpack_message_date (
+  PG_FUNCTION_ARGS
+) {
+  return (dbms_pipe_unpack_message(fcinfo, IT_DATE));
+} /* dbms_pipe_unpack_message_date() */
+
+/* ------------------------------------------------------------------------- */
+
+Datum
+dbms_pipe_unpack_message_timestamp (
+  PG_FUNCTION_ARGS
+) {
+  return (dbms_pipe_unpack_message(fcinfo, IT_TIMESTAMPTZ));
+} /* dbms_pipe_unpack_message_timestamp() */
+
+/* ------------------------------------------------------------------------- */
+
+Datum
+dbms_pipe_unpack_message_number (
+  PG_FUNCTION_ARGS
+) {
+  return (dbms_pipe_unpack_message(fcinfo, IT_NUMBER));
+} /* dbms_pipe_unpack_message_number() */
+
+/* ------------------------------------------------------------------------- */
+
+Datum
+dbms_pipe_unpack_message_bytea (
+  PG_FUNCTION_ARGS
+) {
+  return (dbms_pipe_unpack_message(fcinfo, IT_BYTEA));
+} /* dbms_pipe_unpack_message_bytea() */
+
+/* ------------------------------------------------------------------------- */
+
+Datum
+dbms_pipe_unpack_message_record (
+  PG_FUNCTION_ARGS
+) {
+  return (dbms_pipe_unpack_message(fcinfo, IT_RECORD));
+} /* dbms_pipe_unpack_message_record() */
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * dbms_pipe.pack_message_any(value anyelement)
+ *
+ * Value of any type is packed in its binary format.
+ */
+Datum
+dbms_pipe_pack_message_any (
+  PG_FUNCTION_ARGS
+) {
+  Oid typid = get_fn_expr_argtype(fcinfo->flinfo, 0);
+  type_io_entry *io;
+  bytea *data;
+
+  if (!OidIsValid(typid) || (typid == RECORDOID)) {
+    ereport(ERROR,
+      (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+      errmsg("cannot pack value of unknown type"),
+      errhint("Use dbms_pipe.pack_message for anonymous records.")));
+  }
+
+  io = get_type_io(typid, -1);
+  data = SendFunctionCall(&io->send_finfo, PG_GETARG_DATUM(0));
+
+  output_buffer = check_buffer(output_buffer, VARSIZE(data) - VARHDRSZ);
+  pack_field(output_buffer, IT_BINARY,
+    VARSIZE(data) - VARHDRSZ, VARDATA(data), typid);
+
+  PG_RETURN_VOID();
+} /* dbms_pipe_pack_message_any() */
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * dbms_pipe.unpack_message_any(type_hint anyelement)
+ *
+ * Returns value packed by pack_message_any. Type of argument has to be
+ * the type of packed value, the argument itself is not used.
+ */
+Datum
+dbms_pipe_unpack_message_any (
+  PG_FUNCTION_ARGS
+) {
+  Oid typid = get_fn_expr_argtype(fcinfo->flinfo, 0);
+  type_io_entry *io;
+  message_data_type type;
+  int32 size;
+  Oid tupType;
+  void *ptr;
+  StringInfoData buf;
+  Datum result;
+
+  if ((input_buffer == NULL) ||
+    (input_buffer->items_count <= 0) ||
+    (input_buffer->next == NULL) ||
+    (input_buffer->next->type == IT_NO_MORE_ITEMS)) {
+    PG_RETURN_NULL();
+  }
+
+  if ((input_buffer->next->type != IT_BINARY) ||
+    (input_buffer->next->tupType != typid)) {
+    ereport(ERROR,
+      (errcode(ERRCODE_DATATYPE_MISMATCH),
+      errmsg("datatype mismatch"),
+      errdetail("unpack unexpected type: %d", input_buffer->next->type)));
+  }
+
+  io = get_type_io(typid, -1);
+
+  ptr = unpack_field(input_buffer, &type, &size, &tupType);
+
+  field_to_stringinfo(&buf, ptr, size);
+
+  result = ReceiveFunctionCall(&io->recv_finfo, &buf, io->typioparam, -1);
+
+  if (input_buffer->items_count == 0) {
+    release_input_buffer();
+  }
+
+  PG_RETURN_DATUM(result);
+} /* dbms_pipe_unpack_message_any() */
+
+/* ------------------------------------------------------------------------- */
+
+#define WATCH_PRE(t, et, c)                                                   \
+  et = GetNowFloat() + (float8) t; c = 0;                                     \
+  do {
+
+#define WATCH_POST(t, et, c, e)                                               \
+    if (GetNowFloat() >= et) {                                                \
+      break;                                                                  \
+    }                                                                         \
+    if (0 == (cycle++ % 100)) {                                               \
+      CHECK_FOR_INTERRUPTS();                                                 \
+    }                                                                         \
+    ora_sleep(e);                                                             \
+  } while (0 != t)
+
+/*
+ * Like WATCH_POST, but sleeps until cv is signaled.
+ */
+#define WATCH_WAIT(t, et, c, cv, e)                                           \
+    if (GetNowFloat() >= et) {                                                \
+      break;                                                                  \
+    }                                                                         \
+    ora_cv_sleep(cv, et, e);                                                  \
+  } while (0 != t);                                                           \
+  ora_cv_cancel()
+
+Datum
+dbms_pipe_receive_message (
+  PG_FUNCTION_ARGS
+) {
+  text *pipe_name = NULL;
+  int timeout = ONE_YEAR;
+  int cycle = 0;
+  float8 endtime;
+  bool found = false;
+  bool waited = false;
+
+  if (PG_ARGISNULL(0)) {
+    ereport(ERROR,
+      (errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+      errmsg("pipe name is NULL"),
+      errdetail("Pipename may not be NULL.")));
+  } else {
+    pipe_name = PG_GETARG_TEXT_P(0);
+  }
+
+  if (!PG_ARGISNULL(1)) {
+    timeout = PG_GETARG_INT32(1);
+  }
+
+  release_input_buffer();
+
+  WATCH_PRE(timeout, endtime, cycle);
+  if (NULL != (input_buffer = get_from_pipe(pipe_name, &found,
+    get_input_context()))) {
+    input_buffer->next = message_buffer_get_content(input_buffer);
+    break;
+  }
+/* found empty message */
+  if (found) {
+    break;
+  }
+  waited = true;
+  WATCH_WAIT(timeout, endtime, cycle, pipe_cv(pipe_name),
+    ORA_WAIT_PIPE_RECEIVE);
+
+  if (waited) {
+    count_wait(pipe_name, endtime - (float8) timeout, false,
+      (input_buffer == NULL) && !found);
+  }
+
+  PG_RETURN_INT32(RESULT_DATA);
+} /* dbms_pipe_receive_message() */
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * dbms_pipe.receive_any(pipe_names text[], timeout int)
+ *
+ * Waits for message in any of pipes. The message is received like by
+ * receive_message and the name of its pipe is returned. Returns NULL
+ * after timeout.
+ */
+Datum
+dbms_pipe_receive_any (
+  PG_FUNCTION_ARGS
+) {
+  static int nth = 0;
+
+  ArrayType *array;
+  Datum *elems;
+  bool *nulls;
+  int nelems;
+  text **pipe_names;
+  int timeout = ONE_YEAR;
+  int cycle = 0;
+  float8 endtime;
+  int i;
+  int k = -1;
+  bool waited = false;
+  pipes_scan scan;
+
+  if (PG_ARGISNULL(0)) {
+    ereport(ERROR,
+      (errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+      errmsg("pipe names are NULL"),
+      errdetail("Pipenames may not be NULL.")));
+  }
+
+  array = PG_GETARG_ARRAYTYPE_P(0);
+  deconstruct_array(array, TEXTOID, -1, false, 'i',
+    &elems, &nulls, &nelems);
+
+  if (nelems == 0) {
+    PG_RETURN_NULL();
+  }
+
+  pipe_names = (text **) palloc(nelems * sizeof(text *));
+  for (i = 0; i < nelems; i++) {
+    if (nulls[i]) {
+      ereport(ERROR,
+        (errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+        errmsg("pipe name is NULL"),
+        errdetail("Pipename may not be NULL.")));
+    }
+
+    pipe_names[i] = DatumGetTextP(elems[i]);
+  }
+
+  if (!PG_ARGISNULL(1)) {
+    timeout = PG_GETARG_INT32(1);
+  }
+
+  scan.slots = (int *) palloc(nelems * sizeof(int));
+  scan.versions = (uint32 *) palloc(nelems * sizeof(uint32));
+
+  release_input_buffer();
+
+  /*
+   * data_cv is signaled by message sent to any pipe, so woken waiter
+   * scans its pipes under locks only, when some of them changed.
+   */
+  WATCH_PRE(timeout, endtime, cycle);
+  if (!waited || pipes_changed(&scan, nelems)) {
+    k = get_from_pipes(pipe_names, nelems, nth, &input_buffer,
+        get_input_context(), &scan);
+    if (k >= 0) {
+      if (input_buffer != NULL) {
+        input_buffer->next = message_buffer_get_content(input_buffer);
+      }
+      break;
+    }
+  }
+  waited = true;
+  WATCH_WAIT(timeout, endtime, cycle, &directory->data_cv,
+    ORA_WAIT_PIPE_RECEIVE);
+
+  if (k < 0) {
+    /* timeout is counted to all pipes, which were waited for */
+    if (waited) {
+      for (i = 0; i < nelems; i++) {
+        count_wait(pipe_names[i], endtime - (float8) timeout, false, true);
+      }
+    }
+
+    PG_RETURN_NULL();
+  }
+
+  /* next call starts with following pipe */
+  nth = (k + 1) % nelems;
+
+  if (waited) {
+    count_wait(pipe_names[k], endtime - (float8) timeout, false, false);
+  }
+
+  PG_RETURN_TEXT_P(pipe_names[k]);
+} /* dbms_pipe_receive_any() */
+
+/* ------------------------------------------------------------------------- */
+
+Datum
+dbms_pipe_send_message (
+  PG_FUNCTION_ARGS
+) {
+  text *pipe_name = NULL;
+  int timeout = ONE_YEAR;
+  int limit = 0;
+  bool valid_limit;
+
+  int cycle = 0;
+  float8 endtime;
+  bool sent = false;
+  bool waited = false;
+  message_buffer *msg;
+
+  if (PG_ARGISNULL(0)) {
+    ereport(ERROR,
+      (errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+      errmsg("pipe name is NULL"),
+      errdetail("Pipename may not be NULL.")));
+  } else {
+    pipe_name = PG_GETARG_TEXT_P(0);
+  }
+
+  output_buffer = check_buffer(output_buffer, 0);
+
+  if (!PG_ARGISNULL(1)) {
+    timeout = PG_GETARG_INT32(1);
+  }
+
+  if (PG_ARGISNULL(2)) {
+    valid_limit = false;
+  } else {
+    limit = PG_GETARG_INT32(2);
+    valid_limit = true;
+  }
+
+  release_input_buffer(); /* XXX Strange? */
+
+  msg = compress_message(output_buffer);
+
+  WATCH_PRE(timeout, endtime, cycle);
+  if (add_to_pipe(pipe_name, msg,
+    limit, valid_limit, output_ttl)) {
+    sent = true;
+    break;
+  }
+  waited = true;
+  WATCH_WAIT(timeout, endtime, cycle, &directory->space_cv,
+    ORA_WAIT_PIPE_SEND);
+
+  if (msg != output_buffer) {
+    pfree(msg);
+  }
+
+  if (waited) {
+    count_wait(pipe_name, endtime - (float8) timeout, true, !sent);
+  }
+
+  reset_output_buffer();
+
+  PG_RETURN_INT32(RESULT_DATA);
+} /* dbms_pipe_send_message() */
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * dbms_pipe.send_messages(pipe_name text, messages anyarray,
+ *                         timeout int, pipesize int)
+ *
+ * Every element of array is sent as separate message with one field.
+ * All messages are appended under one lock. Returns number of sent
+ * messages - less than number of elements after timeout.
+ */
+Datum
+dbms_pipe_send_messages (
+  PG_FUNCTION_ARGS
+) {
+  text *pipe_name = NULL;
+  ArrayType *array;
+  int timeout = ONE_YEAR;
+  int limit = 0;
+  bool valid_limit;
+  Oid elemtype;
+  int16 typlen;
+  bool typbyval;
+  char typalign;
+  Datum *elems;
+  bool *nulls;
+  int nelems;
+  message_buffer **messages;
+  int sent = 0;
+  int i;
+
+  int cycle = 0;
+  float8 endtime;
+  bool waited = false;
+
+  if (PG_ARGISNULL(0)) {
+    ereport(ERROR,
+      (errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+      errmsg("pipe name is NULL"),
+      errdetail("Pipename may not be NULL.")));
+  } else {
+    pipe_name = PG_GETARG_TEXT_P(0);
+  }
+
+  if (PG_ARGISNULL(1)) {
+    PG_RETURN_INT32(0);
+  }
+
+  array = PG_GETARG_ARRAYTYPE_P(1);
+
+  if (!PG_ARGISNULL(2)) {
+    timeout = PG_GETARG_INT32(2);
+  }
+
+  if (PG_ARGISNULL(3)) {
+    valid_limit = false;
+  } else {
+    limit = PG_GETARG_INT32(3);
+    valid_limit = true;
+  }
+
+  elemtype = ARR_ELEMTYPE(array);
+  get_typlenbyvalalign(elemtype, &typlen, &typbyval, &typalign);
+  deconstruct_array(array, elemtype, typlen, typbyval, typalign,
+    &elems, &nulls, &nelems);
+
+  if (nelems == 0) {
+    PG_RETURN_INT32(0);
+  }
+
+  /* NULL is sent as empty message */
+  messages = (message_buffer **) palloc(nelems * sizeof(message_buffer *));
+  for (i = 0; i < nelems; i++) {
+    if (nulls[i]) {
+      messages[i] = (message_buffer *) palloc(message_buffer_size);
+      init_buffer(messages[i], message_buffer_size);
+    } else {
+      messages[i] = compress_message(value_message(elems[i], elemtype));
+    }
+  }
+
+  WATCH_PRE(timeout, endtime, cycle);
+  sent += add_messages_to_pipe(pipe_name, messages + sent, nelems - sent,
+      limit, valid_limit, output_ttl);
+  if (sent >= nelems) {
+    break;
+  }
+  waited = true;
+  WATCH_WAIT(timeout, endtime, cycle, &directory->space_cv,
+    ORA_WAIT_PIPE_SEND);
+
+  if (waited) {
+    count_wait(pipe_name, endtime - (float8) timeout, true, sent < nelems);
+  }
+
+  output_ttl = 0;
+
+  PG_RETURN_INT32(sent);
+} /* dbms_pipe_send_messages() */
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * dbms_pipe.receive_messages(pipe_name text, max_count int, timeout int)
+ *
+ * Waits for messages and returns at most max_count of them, all taken
+ * under one lock. Every message is returned as array of its fields
+ * converted to text.
+ */
+Datum
+dbms_pipe_receive_messages (
+  PG_FUNCTION_ARGS
+) {
+  FuncCallContext *funcctx;
+  MessagesFctx *fctx;
+
+  if (SRF_IS_FIRSTCALL()) {
+    MemoryContext oldcontext;
+    text *pipe_name = NULL;
+    int max_count;
+    int timeout = ONE_YEAR;
+    int cycle = 0;
+    float8 endtime;
+    bool waited = false;
+
+    if (PG_ARGISNULL(0)) {
+      ereport(ERROR,
+        (errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+        errmsg("pipe name is NULL"),
+        errdetail("Pipename may not be NULL.")));
+    } else {
+      pipe_name = PG_GETARG_TEXT_P(0);
+    }
+
+    if (PG_ARGISNULL(1) || (PG_GETARG_INT32(1) <= 0)) {
+      ereport(ERROR,
+        (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+        errmsg("max_count must be positive")));
+    }
+
+    max_count = PG_GETARG_INT32(1);
+
+    if (!PG_ARGISNULL(2)) {
+      timeout = PG_GETARG_INT32(2);
+    }
+
+    funcctx = SRF_FIRSTCALL_INIT();
+    oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+    fctx = (MessagesFctx *) palloc0(sizeof(MessagesFctx));
+    funcctx->user_fctx = fctx;
+
+    WATCH_PRE(timeout, endtime, cycle);
+    fctx->count = get_messages_from_pipe(pipe_name, max_count,
+        &fctx->messages);
+    if (fctx->count > 0) {
+      break;
+    }
+    waited = true;
+    WATCH_WAIT(timeout, endtime, cycle, pipe_cv(pipe_name),
+      ORA_WAIT_PIPE_RECEIVE);
+
+    if (waited) {
+      count_wait(pipe_name, endtime - (float8) timeout, false,
+        fctx->count == 0);
+    }
+
+    MemoryContextSwitchTo(oldcontext);
+  }
+
+  funcctx = SRF_PERCALL_SETUP();
+  fctx = (MessagesFctx *) funcctx->user_fctx;
+
+  if (fctx->nth < fctx->count) {
+    message_buffer *buffer = fctx->messages[fctx->nth++];
+    ArrayType *result;
+
+    /* message without fields is returned as empty array */
+    if (buffer != NULL) {
+      result = message_to_array(buffer);
+      pfree(buffer);
+    } else {
+      result = construct_empty_array(TEXTOID);
+    }
+
+    SRF_RETURN_NEXT(funcctx, PointerGetDatum(result));
+  }
+
+  SRF_RETURN_DONE(funcctx);
+} /* dbms_pipe_receive_messages() */
+
+/* ------------------------------------------------------------------------- */
+
+Datum
+dbms_pipe_unique_session_name (
+  PG_FUNCTION_ARGS
+) {
+  StringInfoData strbuf;
+  text *result;
+
+  float8 endtime;
+  int cycle = 0;
+  int timeout = 10;
+
+  WATCH_PRE(timeout, endtime, cycle);
+  if (ora_attach_shmem(SHMEMMSGSZ, MAX_PIPES, MAX_EVENTS, MAX_LOCKS)) {
+    initStringInfo(&strbuf);
+    appendStringInfo(&strbuf, "PG$PIPE$%d$%d", sid, MyProcPid);
+
+    result = cstring_to_text_with_len(strbuf.data, strbuf.len);
+    pfree(strbuf.data);
+
+    PG_RETURN_TEXT_P(result);
+  }
+  WATCH_POST(timeout, endtime, cycle, ORA_WAIT_SHMEM);
+  LOCK_ERROR();
+
+  PG_RETURN_NULL();
+} /* dbms_pipe_unique_session_name() */
+
+/* ------------------------------------------------------------------------- */
+
+#define DB_PIPES_COLS    6
+
+Datum
+dbms_pipe_list_pipes (
+  PG_FUNCTION_ARGS
+) {
+  FuncCallContext *funcctx;
+  TupleDesc tupdesc;
+  AttInMetadata *attinmeta;
+  PipesFctx *fctx;
+
+  float8 endtime;
+  int cycle = 0;
+  int timeout = 10;
+
+  if (SRF_IS_FIRSTCALL()) {
+    int i;
+    MemoryContext oldcontext;
+    bool has_lock = false;
+
+    WATCH_PRE(timeout, endtime, cycle);
+    if (ora_attach_shmem(SHMEMMSGSZ, MAX_PIPES, MAX_EVENTS, MAX_LOCKS)) {
+      LWLockAcquire(directory_lockid, LW_SHARED);
+      has_lock = true;
+      break;
+    }
+    WATCH_POST(timeout, endtime, cycle, ORA_WAIT_SHMEM);
+    if (!has_lock) {
+      LOCK_ERROR();
+    }
+
+    funcctx = SRF_FIRSTCALL_INIT();
+    oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+#if PG_VERSION_NUM >= 120000
+    tupdesc = CreateTemplateTupleDesc(DB_PIPES_COLS);
+#else
+    tupdesc = CreateTemplateTupleDesc(DB_PIPES_COLS, false);
+#endif
+
+    i = 0;
+    TupleDescInitEntry(tupdesc, ++i, "name", VARCHAROID, -1, 0);
+    TupleDescInitEntry(tupdesc, ++i, "items", INT4OID, -1, 0);
+    TupleDescInitEntry(tupdesc, ++i, "size", INT4OID, -1, 0);
+    TupleDescInitEntry(tupdesc, ++i, "limit", INT4OID, -1, 0);
+    TupleDescInitEntry(tupdesc, ++i, "private", BOOLOID, -1, 0);
+    TupleDescInitEntry(tupdesc, ++i, "owner", VARCHAROID, -1, 0);
+    Assert(i == DB_PIPES_COLS);
+
+    attinmeta = TupleDescGetAttInMetadata(tupdesc);
+    funcctx->attinmeta = attinmeta;
+
+    fctx = palloc(sizeof(PipesFctx));
+    funcctx->user_fctx = fctx;
+    fctx->tuples = palloc(MAX_PIPES * sizeof(HeapTuple));
+    fctx->ntuples = 0;
+    fctx->tuple_nth = 0;
+
+    for (i = 0; i < MAX_PIPES; i++) {
+      char *values[DB_PIPES_COLS];
+      char items[16];
+      char size[16];
+      char limit[16];
+      pipe *p = &pipes[i];
+
+      if (!p->is_valid) {
+        continue;
+      }
+
+      /* queue can be changed by holder of pipe lock */
+      LWLockAcquire(pipe_lockid(p), LW_SHARED);
+
+      /* name */
+      values[0] = p->pipe_name;
+      /* items */
+      snprintf(items, lengthof(items), "%d", p->count);
+      values[1] = items;
+      /* size */
+      snprintf(size, lengthof(size), "%d", p->size);
+      values[2] = size;
+      /* limit */
+      if (p->limit != -1) {
+        snprintf(limit, lengthof(limit), "%d", p->limit);
+        values[3] = limit;
+      } else {
+        values[3] = NULL;
+      }
+
+      LWLockRelease(pipe_lockid(p));
+      /* private */
+      values[4] = (p->creator ? "true" : "false");
+      /* owner */
+      values[5] = p->creator;
+
+      fctx->tuples[fctx->ntuples++] = BuildTupleFromCStrings(attinmeta,
+        values);
+    }
+
+    LWLockRelease(directory_lockid);
+
+    MemoryContextSwitchTo(oldcontext);
+  }
+
+  funcctx = SRF_PERCALL_SETUP();
+  fctx = (PipesFctx *) funcctx->user_fctx;
+
+  if (fctx->tuple_nth < fctx->ntuples) {
+    HeapTuple tuple = fctx->tuples[fctx->tuple_nth++];
+
+    SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+  }
+
+  SRF_RETURN_DONE(funcctx);
+} /* dbms_pipe_list_pipes() */
+
+/* ------------------------------------------------------------------------- */
+
+#define PIPE_STATS_COLS    11
+
+/*
+ * Returns counters of all pipes, used by dbms_pipe.pipe_stats view
+ */
+Datum
+dbms_pipe_pipe_stats (
+  PG_FUNCTION_ARGS
+) {
+  FuncCallContext *funcctx;
+  TupleDesc tupdesc;
+  PipesFctx *fctx;
+
+  float8 endtime;
+  int cycle = 0;
+  int timeout = 10;
+
+  if (SRF_IS_FIRSTCALL()) {
+    int i;
+    MemoryContext oldcontext;
+    bool has_lock = false;
+
+    WATCH_PRE(timeout, endtime, cycle);
+    if (ora_attach_shmem(SHMEMMSGSZ, MAX_PIPES, MAX_EVENTS, MAX_LOCKS)) {
+      LWLockAcquire(directory_lockid, LW_SHARED);
+      has_lock = true;
+      break;
+    }
+    WATCH_POST(timeout, endtime, cycle, ORA_WAIT_SHMEM);
+    if (!has_lock) {
+      LOCK_ERROR();
+    }
+
+    funcctx = SRF_FIRSTCALL_INIT();
+    oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+#if PG_VERSION_NUM >= 120000
+    tupdesc = CreateTemplateTupleDesc(PIPE_STATS_COLS);
+#else
+    tupdesc = CreateTemplateTupleDesc(PIPE_STATS_COLS, false);
+#endif
+
+    i = 0;
+    TupleDescInitEntry(tupdesc, ++i, "name", VARCHAROID, -1, 0);
+    TupleDescInitEntry(tupdesc, ++i, "sent", INT8OID, -1, 0);
+    TupleDescInitEntry(tupdesc, ++i, "received", INT8OID, -1, 0);
+    TupleDescInitEntry(tupdesc, ++i, "bytes_sent", INT8OID, -1, 0);
+    TupleDescInitEntry(tupdesc, ++i, "bytes_received", INT8OID, -1, 0);
+    TupleDescInitEntry(tupdesc, ++i, "items", INT4OID, -1, 0);
+    TupleDescInitEntry(tupdesc, ++i, "max_items", INT4OID, -1, 0);
+    TupleDescInitEntry(tupdesc, ++i, "send_timeouts", INT8OID, -1, 0);
+    TupleDescInitEntry(tupdesc, ++i, "receive_timeouts", INT8OID, -1, 0);
+    TupleDescInitEntry(tupdesc, ++i, "wait_time", FLOAT8OID, -1, 0);
+    TupleDescInitEntry(tupdesc, ++i, "expired", INT8OID, -1, 0);
+    Assert(i == PIPE_STATS_COLS);
+
+    funcctx->attinmeta = TupleDescGetAttInMetadata(tupdesc);
+
+    fctx = palloc(sizeof(PipesFctx));
+    funcctx->user_fctx = fctx;
+    fctx->tuples = palloc(MAX_PIPES * sizeof(HeapTuple));
+    fctx->ntuples = 0;
+    fctx->tuple_nth = 0;
+
+    for (i = 0; i < MAX_PIPES; i++) {
+      pipe *p = &pipes[i];
+      pipe_stats stats;
+      int count;
+      char *values[PIPE_STATS_COLS];
+      char buffers[PIPE_STATS_COLS - 1][32];
+      int j;
+
+      if (!p->is_valid) {
+        continue;
+      }
+
+      LWLockAcquire(pipe_lockid(p), LW_SHARED);
+      stats = p->stats;
+      count = p->count;
+      LWLockRelease(pipe_lockid(p));
+
+      values[0] = p->pipe_name;
+      for (j = 1; j < PIPE_STATS_COLS; j++) {
+        values[j] = buffers[j - 1];
+      }
+
+      snprintf(values[1], 32, INT64_FORMAT, stats.sent);
+      snprintf(values[2], 32, INT64_FORMAT, stats.received);
+      snprintf(values[3], 32, INT64_FORMAT, stats.bytes_sent);
+      snprintf(values[4], 32, INT64_FORMAT, stats.bytes_received);
+      snprintf(values[5], 32, "%d", count);
+      snprintf(values[6], 32, "%d", stats.max_count);
+      snprintf(values[7], 32, INT64_FORMAT, stats.send_timeouts);
+      snprintf(values[8], 32, INT64_FORMAT, stats.receive_timeouts);
+      /* in milliseconds like other statistics of PostgreSQL */
+      snprintf(values[9], 32, "%.3f", (double) stats.wait_time / 1000.0);
+      snprintf(values[10], 32, INT64_FORMAT, stats.expired);
+
+      fctx->tuples[fctx->ntuples++] =
+        BuildTupleFromCStrings(funcctx->attinmeta, values);
+    }
+
+    LWLockRelease(directory_lockid);
+
+    MemoryContextSwitchTo(oldcontext);
+  }
+
+  funcctx = SRF_PERCALL_SETUP();
+  fctx = (PipesFctx *) funcctx->user_fctx;
+
+  if (fctx->tuple_nth < fctx->ntuples) {
+    HeapTuple tuple = fctx->tuples[fctx->tuple_nth++];
+
+    SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+  }
+
+  SRF_RETURN_DONE(funcctx);
+} /* dbms_pipe_pipe_stats() */
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * secondary functions
+ */
+
+/*
+ * Registration explicit pipes
+ *   dbms_pipe.create_pipe(pipe_name varchar, limit := -1 int, private := false bool);
+ */
+static void
+create_pipe (
+  text *pipe_name,
+  int   limit,
+  bool  limit_is_valid,
+  bool  is_private,
+  bool  fanout
+) {
+  bool created;
+  float8 endtime;
+  int cycle = 0;
+  int timeout = 10;
+
+  WATCH_PRE(timeout, endtime, cycle);
+  if (ora_attach_shmem(SHMEMMSGSZ, MAX_PIPES, MAX_EVENTS, MAX_LOCKS)) {
+    pipe *p;
+
+    LWLockAcquire(directory_lockid, LW_EXCLUSIVE);
+    if (NULL != (p = find_pipe(pipe_name, &created, false))) {
+      if (!created) {
+        LWLockRelease(directory_lockid);
+        ereport(ERROR,
+          (errcode(ERRCODE_DUPLICATE_OBJECT),
+          errmsg("pipe creation error"),
+          errdetail("Pipe is registered.")));
+      }
+      if (is_private) {
+        char *user;
+
+        p->uid = GetUserId();
+
+#if PG_VERSION_NUM >= 90500
+        user = (char *) DirectFunctionCall1(namein,
+            CStringGetDatum(GetUserNameFromId(p->uid, false)));
+#else
+        user =
+          (char *) DirectFunctionCall1(namein,
+            CStringGetDatum(GetUserNameFromId(p->uid)));
+#endif
+
+        p->creator = ora_sstrcpy(user);
+        pfree(user);
+      }
+      p->limit = limit_is_valid ? limit : -1;
+      p->registered = true;
+      p->fanout = fanout;
+
+      LWLockRelease(directory_lockid);
+      return;
+    }
+    LWLockRelease(directory_lockid);
+  }
+  WATCH_POST(timeout, endtime, cycle, ORA_WAIT_SHMEM);
+  LOCK_ERROR();
+} /* create_pipe() */
+
+/* ------------------------------------------------------------------------- */
+
+Datum
+dbms_pipe_create_pipe (
+  PG_FUNCTION_ARGS
+) {
+  text *pipe_name = NULL;
+  int limit = 0;
+  bool is_private;
+  bool limit_is_valid = false;
+
+  if (PG_ARGISNULL(0)) {
+    ereport(ERROR,
+      (errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+      errmsg("pipe name is NULL"),
+      errdetail("Pipename may not be NULL.")));
+  } else {
+    pipe_name = PG_GETARG_TEXT_P(0);
+  }
+
+  if (!PG_ARGISNULL(1)) {
+    limit = PG_GETARG_INT32(1);
+    limit_is_valid = true;
   }
 
-  WATCH_POST(timeout, endtime, cycle);
-  PG_RETURN_INT32(RESULT_DATA);
-} /* dbms_pipe_receive_message() */
+  is_private = PG_ARGISNULL(2) ? false : PG_GETARG_BOOL(2);
+
+  create_pipe(pipe_name, limit, limit_is_valid, is_private, false);
+
+  PG_RETURN_VOID();
+} /* dbms_pipe_create_pipe() */
 
 /* ------------------------------------------------------------------------- */
 
+/*
+ * dbms_pipe.create_fanout_pipe(pipe_name text, pipesize int)
+ *
+ * Every message of fan-out pipe is received by all sessions subscribed
+ * to pipe. It is stored in shared memory only once.
+ */
 Datum
-dbms_pipe_send_message (
+dbms_pipe_create_fanout_pipe (
   PG_FUNCTION_ARGS
 ) {
-  text *pipe_name = NULL;
-  int timeout = ONE_YEAR;
-  int limit = 0;
-  bool valid_limit;
-
-  int cycle = 0;
-  float8 endtime;
-
   if (PG_ARGISNULL(0)) {
     ereport(ERROR,
       (errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
       errmsg("pipe name is NULL"),
       errdetail("Pipename may not be NULL.")));
-  } else {
-    pipe_name = PG_GETARG_TEXT_P(0);
   }
 
-  output_buffer = check_buffer(output_buffer, LOCALMSGSZ);
+  create_pipe(PG_GETARG_TEXT_P(0),
+    PG_ARGISNULL(1) ? 0 : PG_GETARG_INT32(1), !PG_ARGISNULL(1),
+    false, true);
 
-  if (!PG_ARGISNULL(1)) {
-    timeout = PG_GETARG_INT32(1);
-  }
+  PG_RETURN_VOID();
+} /* dbms_pipe_create_fanout_pipe() */
 
-  if (PG_ARGISNULL(2)) {
-    valid_limit = false;
-  } else {
-    limit = PG_GETARG_INT32(2);
-    valid_limit = true;
-  }
+/* ------------------------------------------------------------------------- */
 
-  if (input_buffer != NULL) { /* XXX Strange? */
-    pfree(input_buffer);
-    input_buffer = NULL;
-  }
+/*
+ * Subscriptions are canceled when session ends, else the messages
+ * would wait for the session forever.
+ */
+static void
+unsubscribe_all (
+  int   code,
+  Datum arg
+) {
+  int i;
 
-  WATCH_PRE(timeout, endtime, cycle);
-  if (add_to_pipe(pipe_name, output_buffer,
-    limit, valid_limit)) {
-    break;
+  if (pipes == NULL) {
+    return;
   }
-  WATCH_POST(timeout, endtime, cycle);
 
-  init_buffer(output_buffer, LOCALMSGSZ);
+  /*
+   * Callback runs before locks are released at exit after error, the
+   * session can still hold locks of pipes.
+   */
+  LWLockReleaseAll();
 
-  PG_RETURN_INT32(RESULT_DATA);
-} /* dbms_pipe_send_message() */
+  LWLockAcquire(directory_lockid, LW_SHARED);
+
+  for (i = 0; i < MAX_PIPES; i++) {
+    pipe *p = &pipes[i];
+
+    if (p->is_valid && p->fanout) {
+      subscriber *s;
+
+      LWLockAcquire(pipe_lockid(p), LW_EXCLUSIVE);
+      if (NULL != (s = find_subscriber(p))) {
+        remove_subscriber(p, s);
+      }
+      LWLockRelease(pipe_lockid(p));
+    }
+  }
+
+  LWLockRelease(directory_lockid);
+} /* unsubscribe_all() */
 
 /* ------------------------------------------------------------------------- */
 
+/*
+ * Session receives messages of fan-out pipe sent after subscription
+ */
 Datum
-dbms_pipe_unique_session_name (
+dbms_pipe_subscribe (
   PG_FUNCTION_ARGS
 ) {
-  StringInfoData strbuf;
-  text *result;
+  static bool exit_callback_registered = false;
 
-  float8 endtime;
-  int cycle = 0;
-  int timeout = 10;
+  text *pipe_name = PG_GETARG_TEXT_P(0);
+  pipe *p;
+  bool created;
 
-  WATCH_PRE(timeout, endtime, cycle);
-  if (ora_lock_shmem(SHMEMMSGSZ, MAX_PIPES, MAX_EVENTS, MAX_LOCKS, false)) {
-    initStringInfo(&strbuf);
-    appendStringInfo(&strbuf, "PG$PIPE$%d$%d", sid, MyProcPid);
+  if (!ora_attach_shmem(SHMEMMSGSZ, MAX_PIPES, MAX_EVENTS, MAX_LOCKS)) {
+    LOCK_ERROR();
+  }
 
-    result = cstring_to_text_with_len(strbuf.data, strbuf.len);
-    pfree(strbuf.data);
-    LWLockRelease(shmem_lockid);
+  if (!exit_callback_registered) {
+    before_shmem_exit(unsubscribe_all, (Datum) 0);
+    exit_callback_registered = true;
+  }
 
-    PG_RETURN_TEXT_P(result);
+  if (NULL == (p = lock_pipe(pipe_name, &created, true))) {
+    ereport(ERROR,
+      (errcode(ERRCODE_UNDEFINED_OBJECT),
+      errmsg("pipe doesn't exist"),
+      errhint("Use dbms_pipe.create_fanout_pipe first.")));
   }
-  WATCH_POST(timeout, endtime, cycle);
-  LOCK_ERROR();
 
-  PG_RETURN_NULL();
-} /* dbms_pipe_unique_session_name() */
+  if (!p->fanout) {
+    unlock_pipe(p);
+    ereport(ERROR,
+      (errcode(ERRCODE_WRONG_OBJECT_TYPE),
+      errmsg("pipe is not fan-out pipe"),
+      errhint("Use dbms_pipe.create_fanout_pipe.")));
+  }
 
-/* ------------------------------------------------------------------------- */
+  if (find_subscriber(p) == NULL) {
+    if (p->nsubscribers >= p->max_subscribers) {
+      int n = p->max_subscribers > 0 ? p->max_subscribers * 2 : 8;
+      subscriber *subscribers;
 
-#define DB_PIPES_COLS    6
+      subscribers = p->subscribers != NULL ?
+        ora_srealloc(p->subscribers, n * sizeof(subscriber)) :
+        ora_salloc(n * sizeof(subscriber));
+      if (subscribers == NULL) {
+        unlock_pipe(p);
+        ereport(ERROR,
+          (errcode(ERRCODE_OUT_OF_MEMORY),
+          errmsg("out of memory"),
+          errdetail("There is not enough shared memory for subscriber."),
+          errhint("Increase orafce.shared_memory_size.")));
+      }
+
+      p->subscribers = subscribers;
+      p->max_subscribers = n;
+    }
+
+    p->subscribers[p->nsubscribers].sid = sid;
+    p->subscribers[p->nsubscribers].cursor = NULL;
+    p->nsubscribers += 1;
+  }
+
+  unlock_pipe(p);
+
+  PG_RETURN_VOID();
+} /* dbms_pipe_subscribe() */
+
+/* ------------------------------------------------------------------------- */
 
 Datum
-dbms_pipe_list_pipes (
+dbms_pipe_unsubscribe (
   PG_FUNCTION_ARGS
 ) {
-  FuncCallContext *funcctx;
-  TupleDesc tupdesc;
-  AttInMetadata *attinmeta;
-  PipesFctx *fctx;
+  text *pipe_name = PG_GETARG_TEXT_P(0);
+  pipe *p;
+  bool created;
 
-  float8 endtime;
-  int cycle = 0;
-  int timeout = 10;
+  if (!ora_attach_shmem(SHMEMMSGSZ, MAX_PIPES, MAX_EVENTS, MAX_LOCKS)) {
+    LOCK_ERROR();
+  }
 
-  if (SRF_IS_FIRSTCALL()) {
-    int i;
-    MemoryContext oldcontext;
-    bool has_lock = false;
+  if (NULL != (p = lock_pipe(pipe_name, &created, true))) {
+    subscriber *s;
 
-    WATCH_PRE(timeout, endtime, cycle);
-    if (ora_lock_shmem(SHMEMMSGSZ, MAX_PIPES, MAX_EVENTS, MAX_LOCKS, false)) {
-      has_lock = true;
-      break;
-    }
-    WATCH_POST(timeout, endtime, cycle);
-    if (!has_lock) {
-      LOCK_ERROR();
+    if (p->fanout && (NULL != (s = find_subscriber(p)))) {
+      remove_subscriber(p, s);
     }
 
-    funcctx = SRF_FIRSTCALL_INIT();
-    oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
-
-    fctx = palloc(sizeof(PipesFctx));
-    funcctx->user_fctx = fctx;
-    fctx->pipe_nth = 0;
+    unlock_pipe(p);
+  }
 
-#if PG_VERSION_NUM >= 120000
-    tupdesc = CreateTemplateTupleDesc(DB_PIPES_COLS);
-#else
-    tupdesc = CreateTemplateTupleDesc(DB_PIPES_COLS, false);
-#endif
+  PG_RETURN_VOID();
+} /* dbms_pipe_unsubscribe() */
 
-    i = 0;
-    TupleDescInitEntry(tupdesc, ++i, "name", VARCHAROID, -1, 0);
-    TupleDescInitEntry(tupdesc, ++i, "items", INT4OID, -1, 0);
-    TupleDescInitEntry(tupdesc, ++i, "size", INT4OID, -1, 0);
-    TupleDescInitEntry(tupdesc, ++i, "limit", INT4OID, -1, 0);
-    TupleDescInitEntry(tupdesc, ++i, "private", BOOLOID, -1, 0);
-    TupleDescInitEntry(tupdesc, ++i, "owner", VARCHAROID, -1, 0);
-    Assert(i == DB_PIPES_COLS);
+/* ------------------------------------------------------------------------- */
 
-    attinmeta = TupleDescGetAttInMetadata(tupdesc);
-    funcctx->attinmeta = attinmeta;
+/*
+ * dbms_pipe.set_spill_threshold(pipe_name text, threshold int)
+ *
+ * Messages of explicit pipe over threshold bytes of shared memory are
+ * stored in spill file in data directory. Zero or NULL stops using
+ * spill file, messages already spilled are still received.
+ */
+Datum
+dbms_pipe_set_spill_threshold (
+  PG_FUNCTION_ARGS
+) {
+  text *pipe_name;
+  int threshold = 0;
+  pipe *p;
+  bool created;
 
-    MemoryContextSwitchTo(oldcontext);
+  if (PG_ARGISNULL(0)) {
+    ereport(ERROR,
+      (errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+      errmsg("pipe name is NULL"),
+      errdetail("Pipename may not be NULL.")));
   }
 
-  funcctx = SRF_PERCALL_SETUP();
-  fctx = (PipesFctx *) funcctx->user_fctx;
+  pipe_name = PG_GETARG_TEXT_P(0);
 
-  while (fctx->pipe_nth < MAX_PIPES) {
-    if (pipes[fctx->pipe_nth].is_valid) {
-      Datum result;
-      HeapTuple tuple;
-      char *values[DB_PIPES_COLS];
-      char items[16];
-      char size[16];
-      char limit[16];
+  if (!PG_ARGISNULL(1)) {
+    threshold = PG_GETARG_INT32(1);
+  }
 
-      /* name */
-      values[0] = pipes[fctx->pipe_nth].pipe_name;
-      /* items */
-      snprintf(items, lengthof(items), "%d", pipes[fctx->pipe_nth].count);
-      values[1] = items;
-      /* items */
-      snprintf(size, lengthof(size), "%d", pipes[fctx->pipe_nth].size);
-      values[2] = size;
-      /* limit */
-      if (pipes[fctx->pipe_nth].limit != -1) {
-        snprintf(limit, lengthof(limit), "%d", pipes[fctx->pipe_nth].limit);
-        values[3] = limit;
-      } else {
-        values[3] = NULL;
-      }
-      /* private */
-      values[4] = (pipes[fctx->pipe_nth].creator ? "true" : "false");
-      /* owner */
-      values[5] = pipes[fctx->pipe_nth].creator;
+  if (threshold < 0) {
+    ereport(ERROR,
+      (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+      errmsg("spill threshold must not be negative")));
+  }
 
-      tuple = BuildTupleFromCStrings(funcctx->attinmeta, values);
-      result = HeapTupleGetDatum(tuple);
+  if (!ora_attach_shmem(SHMEMMSGSZ, MAX_PIPES, MAX_EVENTS, MAX_LOCKS)) {
+    LOCK_ERROR();
+  }
 
-      fctx->pipe_nth += 1;
-      SRF_RETURN_NEXT(funcctx, result);
+  if ((NULL == (p = lock_pipe(pipe_name, &created, true))) ||
+    !p->registered || p->fanout) {
+    if (p != NULL) {
+      unlock_pipe(p);
     }
-    fctx->pipe_nth += 1;
+
+    ereport(ERROR,
+      (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+      errmsg("pipe cannot use spill file"),
+      errdetail("Only explicit pipes, which are not fan-out pipes, can use spill file."),
+      errhint("Use dbms_pipe.create_pipe first.")));
   }
 
-  LWLockRelease(shmem_lockid);
-  SRF_RETURN_DONE(funcctx);
-} /* dbms_pipe_list_pipes() */
+  p->spill_threshold = threshold;
 
-/* ------------------------------------------------------------------------- */
+  unlock_pipe(p);
 
-/*
- * secondary functions
- */
+  PG_RETURN_VOID();
+} /* dbms_pipe_set_spill_threshold() */
+
+/* ------------------------------------------------------------------------- */
 
 /*
- * Registration explicit pipes
- *   dbms_pipe.create_pipe(pipe_name varchar, limit := -1 int, private := false bool);
+ * dbms_pipe.set_pipe_ttl(pipe_name text, ttl int)
+ *
+ * Messages sent to explicit pipe expire after ttl seconds, when they are
+ * not received. Zero or NULL disables expiry of next messages.
  */
 Datum
-dbms_pipe_create_pipe (
+dbms_pipe_set_pipe_ttl (
   PG_FUNCTION_ARGS
 ) {
-  text *pipe_name = NULL;
-  int limit = 0;
-  bool is_private;
-  bool limit_is_valid = false;
+  text *pipe_name;
+  int ttl = 0;
+  pipe *p;
   bool created;
-  float8 endtime;
-  int cycle = 0;
-  int timeout = 10;
 
   if (PG_ARGISNULL(0)) {
     ereport(ERROR,
       (errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
       errmsg("pipe name is NULL"),
       errdetail("Pipename may not be NULL.")));
-  } else {
-    pipe_name = PG_GETARG_TEXT_P(0);
   }
 
+  pipe_name = PG_GETARG_TEXT_P(0);
+
   if (!PG_ARGISNULL(1)) {
-    limit = PG_GETARG_INT32(1);
-    limit_is_valid = true;
+    ttl = PG_GETARG_INT32(1);
   }
 
-  is_private = PG_ARGISNULL(2) ? false : PG_GETARG_BOOL(2);
+  if (ttl < 0) {
+    ereport(ERROR,
+      (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+      errmsg("time to live must not be negative")));
+  }
 
-  WATCH_PRE(timeout, endtime, cycle);
-  if (ora_lock_shmem(SHMEMMSGSZ, MAX_PIPES, MAX_EVENTS, MAX_LOCKS, false)) {
-    pipe *p;
-    if (NULL != (p = find_pipe(pipe_name, &created, false))) {
-      if (!created) {
-        LWLockRelease(shmem_lockid);
-        ereport(ERROR,
-          (errcode(ERRCODE_DUPLICATE_OBJECT),
-          errmsg("pipe creation error"),
-          errdetail("Pipe is registered.")));
-      }
-      if (is_private) {
-        char *user;
+  if (!ora_attach_shmem(SHMEMMSGSZ, MAX_PIPES, MAX_EVENTS, MAX_LOCKS)) {
+    LOCK_ERROR();
+  }
 
-        p->uid = GetUserId();
+  if ((NULL == (p = lock_pipe(pipe_name, &created, true))) ||
+    !p->registered) {
+    if (p != NULL) {
+      unlock_pipe(p);
+    }
 
-#if PG_VERSION_NUM >= 90500
-        user = (char *) DirectFunctionCall1(namein,
-            CStringGetDatum(GetUserNameFromId(p->uid, false)));
-#else
-        user =
-          (char *) DirectFunctionCall1(namein,
-            CStringGetDatum(GetUserNameFromId(p->uid)));
-#endif
+    ereport(ERROR,
+      (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+      errmsg("pipe cannot have time to live"),
+      errdetail("Only explicit pipes have time to live."),
+      errhint("Use dbms_pipe.create_pipe first.")));
+  }
 
-        p->creator = ora_sstrcpy(user);
-        pfree(user);
-      }
-      p->limit = limit_is_valid ? limit : -1;
-      p->registered = true;
+  p->ttl = ttl;
 
-      LWLockRelease(shmem_lockid);
-      PG_RETURN_VOID();
-    }
+  unlock_pipe(p);
+
+  PG_RETURN_VOID();
+} /* dbms_pipe_set_pipe_ttl() */
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * dbms_pipe.set_message_ttl(ttl int)
+ *
+ * Next message sent by session (or all messages of next send_messages)
+ * expires after ttl seconds. It overrides time to live of pipe.
+ */
+Datum
+dbms_pipe_set_message_ttl (
+  PG_FUNCTION_ARGS
+) {
+  int ttl = PG_ARGISNULL(0) ? 0 : PG_GETARG_INT32(0);
+
+  if (ttl < 0) {
+    ereport(ERROR,
+      (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+      errmsg("time to live must not be negative")));
   }
-  WATCH_POST(timeout, endtime, cycle);
-  LOCK_ERROR();
+
+  output_ttl = ttl;
 
   PG_RETURN_VOID();
-} /* dbms_pipe_create_pipe() */
+} /* dbms_pipe_set_message_ttl() */
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Returns bytes copied to local memory by receiving of messages in this
+ * session. Unpacking of values doesn't copy them.
+ */
+Datum
+dbms_pipe_received_bytes_copied (
+  PG_FUNCTION_ARGS
+) {
+  PG_RETURN_INT64(input_bytes_copied);
+} /* dbms_pipe_received_bytes_copied() */
 
 /* ------------------------------------------------------------------------- */
 
@@ -1279,12 +4544,12 @@ dbms_pipe_reset_buffer (
   if (output_buffer != NULL) {
     pfree(output_buffer);
     output_buffer = NULL;
+    output_buffer_capacity = 0;
   }
 
-  if (input_buffer != NULL) {
-    pfree(input_buffer);
-    input_buffer = NULL;
-  }
+  output_ttl = 0;
+
+  release_input_buffer();
 
   PG_RETURN_VOID();
 } /* dbms_pipe_reset_buffer() */
@@ -1306,13 +4571,14 @@ dbms_pipe_purge (
   int timeout = 10;
 
   WATCH_PRE(timeout, endtime, cycle);
-  if (ora_lock_shmem(SHMEMMSGSZ, MAX_PIPES, MAX_EVENTS, MAX_LOCKS, false)) {
+  if (ora_attach_shmem(SHMEMMSGSZ, MAX_PIPES, MAX_EVENTS, MAX_LOCKS)) {
+    LWLockAcquire(directory_lockid, LW_EXCLUSIVE);
     remove_pipe(pipe_name, true);
-    LWLockRelease(shmem_lockid);
+    LWLockRelease(directory_lockid);
 
     PG_RETURN_VOID();
   }
-  WATCH_POST(timeout, endtime, cycle);
+  WATCH_POST(timeout, endtime, cycle, ORA_WAIT_SHMEM);
   LOCK_ERROR();
 
   PG_RETURN_VOID();
@@ -1334,13 +4600,14 @@ dbms_pipe_remove_pipe (
   int timeout = 10;
 
   WATCH_PRE(timeout, endtime, cycle);
-  if (ora_lock_shmem(SHMEMMSGSZ, MAX_PIPES, MAX_EVENTS, MAX_LOCKS, false)) {
+  if (ora_attach_shmem(SHMEMMSGSZ, MAX_PIPES, MAX_EVENTS, MAX_LOCKS)) {
+    LWLockAcquire(directory_lockid, LW_EXCLUSIVE);
     remove_pipe(pipe_name, false);
-    LWLockRelease(shmem_lockid);
+    LWLockRelease(directory_lockid);
 
     PG_RETURN_VOID();
   }
-  WATCH_POST(timeout, endtime, cycle);
+  WATCH_POST(timeout, endtime, cycle, ORA_WAIT_SHMEM);
   LOCK_ERROR();
 
   PG_RETURN_VOID();
@@ -38,17 +38,97 @@
 char *nls_date_format = NULL;
 char *orafce_timezone = NULL;
 
+/* shared memory of dbms_pipe and dbms_alert */
+int orafce_shared_memory_size = 30;
+int orafce_max_pipes = 30;
+int orafce_max_events = 30;
+int orafce_max_locks = 256;
+
+/* local pack buffer of dbms_pipe */
+int orafce_pipe_max_message_size = 8;
+int orafce_pipe_compression_threshold = 4;
+
+/* LISTEN/NOTIFY channels of dbms_alert */
+char *orafce_alert_notify_prefix = NULL;
+
 void
 _PG_init (
   void
 ) {
+  /* Define custom GUC variables. */
+  DefineCustomIntVariable("orafce.shared_memory_size",
+    "Size of shared memory used by dbms_pipe and dbms_alert messages.",
+    NULL,
+    &orafce_shared_memory_size,
+    30,
+    16,
+    1024*1024,
+    PGC_POSTMASTER,
+    GUC_UNIT_KB,
+    NULL, NULL, NULL);
+
+  DefineCustomIntVariable("orafce.max_pipes",
+    "Maximum number of dbms_pipe pipes.",
+    NULL,
+    &orafce_max_pipes,
+    30,
+    1,
+    100000,
+    PGC_POSTMASTER,
+    0,
+    NULL, NULL, NULL);
+
+  DefineCustomIntVariable("orafce.max_events",
+    "Maximum number of dbms_alert events.",
+    NULL,
+    &orafce_max_events,
+    30,
+    1,
+    100000,
+    PGC_POSTMASTER,
+    0,
+    NULL, NULL, NULL);
+
+  DefineCustomIntVariable("orafce.max_locks",
+    "Maximum number of sessions collaborating via dbms_alert.",
+    NULL,
+    &orafce_max_locks,
+    256,
+    1,
+    100000,
+    PGC_POSTMASTER,
+    0,
+    NULL, NULL, NULL);
+
+  DefineCustomIntVariable("orafce.pipe_max_message_size",
+    "Maximum size of a message packed by dbms_pipe.",
+    NULL,
+    &orafce_pipe_max_message_size,
+    8,
+    1,
+    MaxAllocSize / 1024,
+    PGC_USERSET,
+    GUC_UNIT_KB,
+    NULL, NULL, NULL);
+
+  DefineCustomIntVariable("orafce.pipe_compression_threshold",
+    "Messages bigger than this size are sent compressed by dbms_pipe.",
+    "Zero disables compression.",
+    &orafce_pipe_compression_threshold,
+    4,
+    0,
+    MaxAllocSize / 1024,
+    PGC_USERSET,
+    GUC_UNIT_KB,
+    NULL, NULL, NULL);
+
+  RequestAddinShmemSpace(ora_shmem_size(SHMEMMSGSZ, MAX_PIPES, MAX_EVENTS,
+    MAX_LOCKS));
 #if PG_VERSION_NUM < 90600
-  RequestAddinLWLocks(1);
+  /* pipe directory, alerts, shmem allocator and one lock per pipe */
+  RequestAddinLWLocks(3 + MAX_PIPES);
 #endif
 
-  RequestAddinShmemSpace(SHMEMMSGSZ);
-
-  /* Define custom GUC variables. */
   DefineCustomStringVariable("orafce.nls_date_format",
     "Emulate oracle's date output behaviour.",
     NULL,
@@ -59,6 +139,15 @@ _PG_init (
     NULL,
     NULL, NULL);
 
+  DefineCustomStringVariable("orafce.alert_notify_prefix",
+    "Prefix of NOTIFY channels of dbms_alert alerts.",
+    "Empty string disables NOTIFY of alerts.",
+    &orafce_alert_notify_prefix,
+    "",
+    PGC_SUSET,
+    0,
+    NULL, NULL, NULL);
+
   DefineCustomStringVariable("orafce.timezone",
     "Specify timezone used for sysdate function.",
     NULL,
@@ -29,6 +29,22 @@
  * Shared memory control - based on alocating chunks aligned on
  * asize array (fibonachi), and dividing free bigger block.
  *
+ * Free blocks are kept in segregated lists, one per asize class. A free
+ * block is stored in the list of the biggest class that it can satisfy,
+ * so any block taken from list of requested (or higher) class is big enough
+ * and allocation doesn't need to search.
+ *
+ * Every block starts by header with its size and size of physically
+ * preceding block (boundary tag). Released block finds its neighbours
+ * and is merged with free ones immediately, so no global defragmentation
+ * is necessary. There is no separate table of blocks, so the number of
+ * blocks is limited only by size of memory.
+ *
+ * The memory is shared by all dbms_pipe and dbms_alert operations, so the
+ * allocator has its own lock, that is always acquired as last one. Every
+ * released block is announced on freed_cv, where sessions waiting for
+ * memory sleep, whatever package released it.
+ *
  */
 
 #include "postgres.h"
@@ -36,24 +52,47 @@
 #include "stdlib.h"
 #include "string.h"
 #include "orafce.h"
+#include "storage/lwlock.h"
 
 #include "stdint.h"
 
-#define LIST_ITEMS    512
+#define ASIZE_ITEMS   17
+
+#define NOT_USED      -1
 
 int context;
 
+/*
+ * Header of every block - the caller gets pointer behind it. Sizes
+ * include header.
+ */
 typedef struct {
-  size_t size;
-  void  *first_byte_ptr;
-  bool   dispossible;
+  uint32 size;
+  uint32 prev_size;   /* 0 for first block */
+  uint32 magic;
 /*	int16 context; */
-} list_item;
+} block_header;
+
+#define BLOCK_USED_MAGIC     0x0DAF00CE
+#define BLOCK_FREE_MAGIC     0x0DAFFEEE
+#define BLOCK_HEADER_SIZE    (MAXALIGN(sizeof(block_header)))
+
+#define block_is_free(b)     ((b)->magic == BLOCK_FREE_MAGIC)
+
+/*
+ * Free block holds links of its free list, so asize[0] has to be
+ * greater or equal to sizeof(free_block).
+ */
+typedef struct free_block {
+  block_header       header;
+  struct free_block *prev_free;
+  struct free_block *next_free;
+} free_block;
 
 typedef struct {
-  int     list_c;
-  size_t  max_size;
-  vardata data[1];   /* flexible array member */
+  free_block *free_lists[ASIZE_ITEMS];  /* free blocks by size class */
+  size_t      max_size;
+  vardata     data[1];   /* flexible array member */
 } mem_desc;
 
 #define MAX_SIZE    82688
@@ -67,28 +106,171 @@ static size_t asize[] =
   19520,    31584, 51104, 82688
 };
 
-int *list_c = NULL;
-list_item *list = NULL;
 size_t max_size;
 
+static free_block **free_lists = NULL;
+
+static LWLockId alloc_lockid = NULL;
+static ora_cv *freed_cv = NULL;
+
+static char *heap_start = NULL;
+static char *heap_end = NULL;
+
 int cycle = 0;
 
-/* align requested size */
+/* ------------------------------------------------------------------------- */
 
+/*
+ * Returns index of biggest class, that can be satisfied by block of
+ * this size, or NOT_USED for too small blocks.
+ */
 static int
-ptr_comp (
-  const void *a,
-  const void *b
+size_class (
+  size_t size
+) {
+  int i;
+
+  for (i = ASIZE_ITEMS - 1; i >= 0; i--) {
+    if (asize[i] <= size) {
+      return (i);
+    }
+  }
+
+  return (NOT_USED);
+} /* size_class() */
+
+/* ------------------------------------------------------------------------- */
+
+static block_header *
+next_block (
+  block_header *b
+) {
+  char *next = ((char *) b) + b->size;
+
+  return (next < heap_end ? (block_header *) next : NULL);
+} /* next_block() */
+
+/* ------------------------------------------------------------------------- */
+
+static block_header *
+prev_block (
+  block_header *b
+) {
+  return (b->prev_size > 0 ?
+    (block_header *) (((char *) b) - b->prev_size) : NULL);
+} /* prev_block() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+push_free (
+  block_header *b
+) {
+  free_block *fb = (free_block *) b;
+  int cls = size_class(b->size);
+
+  b->magic = BLOCK_FREE_MAGIC;
+  fb->prev_free = NULL;
+
+  /* too small block stays out of lists and waits for merge */
+  if (cls == NOT_USED) {
+    fb->next_free = NULL;
+    return;
+  }
+
+  fb->next_free = free_lists[cls];
+  if (free_lists[cls] != NULL) {
+    free_lists[cls]->prev_free = fb;
+  }
+  free_lists[cls] = fb;
+} /* push_free() */
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Block's size has to be same as in push time, because it determines
+ * the list.
+ */
+static void
+unlink_free (
+  block_header *b
 ) {
-  ptrdiff_t d;
+  free_block *fb = (free_block *) b;
+  int cls = size_class(b->size);
 
-  list_item *_a = (list_item *) a;
-  list_item *_b = (list_item *) b;
+  if (fb->prev_free != NULL) {
+    fb->prev_free->next_free = fb->next_free;
+  } else if (cls != NOT_USED) {
+    free_lists[cls] = fb->next_free;
+  }
+
+  if (fb->next_free != NULL) {
+    fb->next_free->prev_free = fb->prev_free;
+  }
+
+  fb->prev_free = fb->next_free = NULL;
+} /* unlink_free() */
+
+/* ------------------------------------------------------------------------- */
 
-  d = (uintptr_t) _a->first_byte_ptr - (uintptr_t) _b->first_byte_ptr;
+/*
+ * Append physically following block next to block b. Both blocks
+ * have to be out of free lists.
+ */
+static void
+merge_next (
+  block_header *b,
+  block_header *next
+) {
+  block_header *after;
+
+  b->size += next->size;
+  next->magic = 0;
+
+  if (NULL != (after = next_block(b))) {
+    after->prev_size = b->size;
+  }
+} /* merge_next() */
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Returns header of used block. Raise exception when ptr isn't
+ * pointer returned by ora_salloc.
+ */
+static block_header *
+ptr_block (
+  void *ptr
+) {
+  block_header *b = (block_header *) ((char *) ptr - BLOCK_HEADER_SIZE);
+
+  if (((char *) b >= heap_start) &&
+    ((char *) ptr < heap_end) &&
+    ((((char *) b - heap_start) % MAXIMUM_ALIGNOF) == 0) &&
+    (b->magic == BLOCK_USED_MAGIC) &&
+    (b->size <= (size_t) (heap_end - (char *) b))) {
+    block_header *neighbour;
+
+    /* check boundary tags of neighbours too */
+    neighbour = prev_block(b);
+    if ((neighbour == NULL) ||
+      (((char *) neighbour >= heap_start) &&
+      (neighbour->size == b->prev_size))) {
+      neighbour = next_block(b);
+      if ((neighbour == NULL) || (neighbour->prev_size == b->size)) {
+        return (b);
+      }
+    }
+  }
+
+  ereport(ERROR,
+    (errcode(ERRCODE_INTERNAL_ERROR),
+    errmsg("corrupted pointer"),
+    errdetail("Failed while reallocating memory block in shared memory."),
+    errhint("Report this bug to autors.")));
 
-  return (d > 0 ? 1 : (d < 0 ? -1 : 0));
-} /* ptr_comp() */
+  return (NULL);
+} /* ptr_block() */
 
 /* ------------------------------------------------------------------------- */
 
@@ -108,7 +290,7 @@ ora_sstrcpy (
       errmsg("out of memory"),
       errdetail("Failed while allocation block %d bytes in shared memory.",
       (int) len+1),
-      errhint("Increase SHMEMMSGSZ and recompile package.")));
+      errhint("Increase orafce.shared_memory_size.")));
   }
 
   return (result);
@@ -134,7 +316,7 @@ ora_scstring (
       errmsg("out of memory"),
       errdetail("Failed while allocation block %d bytes in shared memory.",
       (int) len+1),
-      errhint("Increase SHMEMMSGSZ and recompile package.")));
+      errhint("Increase orafce.shared_memory_size.")));
   }
 
   return (result);
@@ -142,184 +324,206 @@ ora_scstring (
 
 /* ------------------------------------------------------------------------- */
 
-/*
- * Compact the list of slots, by merging adjacent unused slots into larger
- * slots.
- */
-static void
-defragmentation () {
-  int src, target;
-
-  /* Sort the array to pointer order */
-  qsort(list, *list_c, sizeof(list_item), ptr_comp);
-
-  /* Merge adjacent dispossible slots, and move up other slots */
-  target = 0;
-  for (src = 0; src < *list_c; src++) {
-    if ((target > 0) &&
-      list[src].dispossible &&
-      list[target - 1].dispossible) {
-      list[target - 1].size += list[src].size;
-    } else {
-      if (src != target) {
-        memcpy(&list[target], &list[src], sizeof(list_item));
-      }
-      target++;
-    }
-  }
-  *list_c = target;
-}
-
-/* ------------------------------------------------------------------------- */
-
 static size_t
 align_size (
   size_t size
 ) {
   int i;
 
-  /* default, we can allocate max MAX_SIZE memory block */
-
-  for (i = 0; i < 17; i++) {
+  for (i = 0; i < ASIZE_ITEMS; i++) {
     if (asize[i] >= size) {
       return (asize[i]);
     }
   }
 
-  ereport(ERROR,
-    (errcode(ERRCODE_OUT_OF_MEMORY),
-    errmsg("too much large memory block request"),
-    errdetail("Failed while allocation block %lu bytes in shared memory.",
-    (unsigned long) size),
-    errhint(
-      "Increase MAX_SIZE constant, fill table a_size and recompile package.")));
-
-  return (0);
+  /* blocks bigger than MAX_SIZE are only aligned */
+  if (size > MaxAllocSize) {
+    ereport(ERROR,
+      (errcode(ERRCODE_OUT_OF_MEMORY),
+      errmsg("too much large memory block request"),
+      errdetail("Failed while allocation block %lu bytes in shared memory.",
+      (unsigned long) size)));
+  }
+
+  return (MAXALIGN(size));
 } /* align_size() */
 
 /* ------------------------------------------------------------------------- */
 
 /*
  * initialize shared memory. It works in two modes, create and no create.
- * No create is used for mounting shared memory buffer. Top of memory is
- * used for list_item array.
+ * No create is used for mounting shared memory buffer. Whole memory behind
+ * mem_desc is one free block at start. Lock protects all operations over
+ * this memory, cv is broadcast when memory is released.
  */
 void
 ora_sinit (
-  void  *ptr,
-  size_t size,
-  bool   create
+  void    *ptr,
+  size_t   size,
+  bool     create,
+  LWLockId lock,
+  ora_cv  *cv
 ) {
-  if (list == NULL) {
+  if (free_lists == NULL) {
     mem_desc *m = (mem_desc *) ptr;
-    list = (list_item *) m->data;
-    list_c = &m->list_c;
-    max_size = m->max_size = size;
+
+    alloc_lockid = lock;
+    freed_cv = cv;
+
+    free_lists = m->free_lists;
+    heap_start = (char *) m->data;
+    heap_end = heap_start +
+      MAXALIGN_DOWN(size - offsetof(mem_desc, data));
 
     if (create) {
-      list[0].size = size - sizeof(list_item)*LIST_ITEMS - sizeof(mem_desc);
-      list[0].first_byte_ptr = ((char *) &m->data) + sizeof(list_item)*
-        LIST_ITEMS;
-      list[0].dispossible = true;
-      *list_c = 1;
+      block_header *b = (block_header *) heap_start;
+      int i;
+
+      for (i = 0; i < ASIZE_ITEMS; i++) {
+        free_lists[i] = NULL;
+      }
+
+      m->max_size = size;
+
+      b->size = heap_end - heap_start;
+      b->prev_size = 0;
+      push_free(b);
     }
+
+    max_size = m->max_size;
   }
 } /* ora_sinit() */
 
 /* ------------------------------------------------------------------------- */
 
-void *
-ora_salloc (
+static void *
+shm_alloc (
   size_t size
 ) {
   size_t aligned_size;
-  int repeat_c;
-  void *ptr = NULL;
-
-  aligned_size = align_size(size);
-
-  for (repeat_c = 0; repeat_c < 2; repeat_c++) {
-    size_t max_min = max_size;
-    int select = -1;
-    int i;
-
-    /* find first good free block */
-    for (i = 0; i < *list_c; i++) {
-      if (list[i].dispossible) {
-        /* If this block is just the right size, return it */
-        if (list[i].size == aligned_size) {
-          list[i].dispossible = false;
-          ptr = list[i].first_byte_ptr;
-          /* list[i].context = context; */
-
-          return (ptr);
-        }
-
-        if ((list[i].size > aligned_size) && (list[i].size < max_min)) {
-          max_min = list[i].size;
-          select = i;
-        }
+  block_header *b = NULL;
+  int cls;
+
+  aligned_size = align_size(size + BLOCK_HEADER_SIZE);
+
+  /*
+   * Every block in list of requested class or in list of some higher
+   * class is good enough, so the first one is taken. Only blocks
+   * bigger than MAX_SIZE have to be searched in the last list.
+   */
+  for (cls = size_class(aligned_size); cls < ASIZE_ITEMS; cls++) {
+    free_block *fb;
+
+    for (fb = free_lists[cls]; fb != NULL; fb = fb->next_free) {
+      if (fb->header.size >= aligned_size) {
+        b = (block_header *) fb;
+        break;
       }
     }
 
-    /* If no suitable free slot found, defragment and try again. */
-    if ((select == -1) || (*list_c == LIST_ITEMS)) {
-      defragmentation();
-      continue;
+    if (b != NULL) {
+      break;
     }
+  }
 
-    /*
-     * A slot larger than required was found. Divide it to avoid wasting
-     * space, and return the slot of the right size.
-     */
-    list[*list_c].size = list[select].size - aligned_size;
-    list[*list_c].first_byte_ptr = (char *) list[select].first_byte_ptr +
-      aligned_size;
-    list[*list_c].dispossible = true;
-    list[select].size = aligned_size;
-    list[select].dispossible = false;
-    /* list[select].context = context; */
-    ptr = list[select].first_byte_ptr;
-    *list_c += 1;
-    break;
+  if (b == NULL) {
+    return (NULL);
   }
 
-  return (ptr);
-} /* ora_salloc() */
+  unlink_free(b);
+
+  /*
+   * A block larger than required was found. Divide it to avoid wasting
+   * space, and return the block of the right size.
+   */
+  if (b->size - aligned_size >= asize[0]) {
+    block_header *rest = (block_header *) (((char *) b) + aligned_size);
+    block_header *after;
+
+    rest->size = b->size - aligned_size;
+    rest->prev_size = aligned_size;
+    if (NULL != (after = next_block(rest))) {
+      after->prev_size = rest->size;
+    }
+    b->size = aligned_size;
+
+    push_free(rest);
+  }
+
+  b->magic = BLOCK_USED_MAGIC;
+  /* b->context = context; */
+
+  return (((char *) b) + BLOCK_HEADER_SIZE);
+} /* shm_alloc() */
 
 /* ------------------------------------------------------------------------- */
 
-void
-ora_sfree (
+static void
+shm_free (
   void *ptr
 ) {
-  int i;
+  block_header *b;
+  block_header *neighbour;
 
 /*
  * if (cycle++ % 100 == 0)
  * {
  *  size_t suma = 0;
- *  for (i = 0; i < *list_c; i++)
- *    if (list[i].dispossible)
- *      suma += list[i].size;
+ *  for (b = heap_start; b != NULL; b = next_block(b))
+ *    if (block_is_free(b))
+ *      suma += b->size;
  *  elog(NOTICE, "=============== FREE MEM REPORT === %10d ================", suma);
  * }
  */
 
-  for (i = 0; i < *list_c; i++) {
-    if (list[i].first_byte_ptr == ptr) {
-      list[i].dispossible = true;
-      /* list[i].context = -1; */
-      memset(list[i].first_byte_ptr, '#', list[i].size);
-      return;
-    }
+  b = ptr_block(ptr);
+
+  /* b->context = -1; */
+  memset(ptr, '#', b->size - BLOCK_HEADER_SIZE);
+
+  /* merge with free neighbours */
+  neighbour = next_block(b);
+  if ((neighbour != NULL) && block_is_free(neighbour)) {
+    unlink_free(neighbour);
+    merge_next(b, neighbour);
   }
 
-  ereport(ERROR,
-    (errcode(ERRCODE_INTERNAL_ERROR),
-    errmsg("corrupted pointer"),
-    errdetail("Failed while reallocating memory block in shared memory."),
-    errhint("Report this bug to autors.")));
+  neighbour = prev_block(b);
+  if ((neighbour != NULL) && block_is_free(neighbour)) {
+    unlink_free(neighbour);
+    merge_next(neighbour, b);
+    b = neighbour;
+  }
+
+  push_free(b);
+} /* shm_free() */
+
+/* ------------------------------------------------------------------------- */
+
+void *
+ora_salloc (
+  size_t size
+) {
+  void *result;
+
+  LWLockAcquire(alloc_lockid, LW_EXCLUSIVE);
+  result = shm_alloc(size);
+  LWLockRelease(alloc_lockid);
+
+  return (result);
+} /* ora_salloc() */
+
+/* ------------------------------------------------------------------------- */
+
+void
+ora_sfree (
+  void *ptr
+) {
+  LWLockAcquire(alloc_lockid, LW_EXCLUSIVE);
+  shm_free(ptr);
+  LWLockRelease(alloc_lockid);
+
+  ora_cv_broadcast(freed_cv);
 } /* ora_sfree() */
 
 /* ------------------------------------------------------------------------- */
@@ -329,32 +533,23 @@ ora_srealloc (
   void  *ptr,
   size_t size
 ) {
-  void *result;
-  size_t aux_s = 0;
-  int i;
+  void *result = ptr;
+  block_header *b;
 
-  for (i = 0; i < *list_c; i++) {
-    if (list[i].first_byte_ptr == ptr) {
-      if (align_size(size) <= list[i].size) {
-        return (ptr);
-      }
-      aux_s = list[i].size;
-    }
-  }
+  LWLockAcquire(alloc_lockid, LW_EXCLUSIVE);
 
-  if (aux_s == 0) {
-    ereport(ERROR,
-      (errcode(ERRCODE_INTERNAL_ERROR),
-      errmsg("corrupted pointer"),
-      errdetail("Failed while reallocating memory block in shared memory."),
-      errhint("Report this bug to autors.")));
-  }
+  b = ptr_block(ptr);
+  if (align_size(size + BLOCK_HEADER_SIZE) > b->size) {
+    size_t aux_s = b->size - BLOCK_HEADER_SIZE;
 
-  if (NULL != (result = ora_salloc(size))) {
-    memcpy(result, ptr, aux_s);
-    ora_sfree(ptr);
+    if (NULL != (result = shm_alloc(size))) {
+      memcpy(result, ptr, aux_s);
+      shm_free(ptr);
+    }
   }
 
+  LWLockRelease(alloc_lockid);
+
   return (result);
 } /* ora_srealloc() */
 
@@ -375,7 +570,7 @@ salloc (
       errmsg("out of memory"),
       errdetail("Failed while allocation block %lu bytes in shared memory.",
       (unsigned long) size),
-      errhint("Increase SHMEMMSGSZ and recompile package.")));
+      errhint("Increase orafce.shared_memory_size.")));
   }
 
   return (result);
@@ -396,7 +591,7 @@ srealloc (
       errmsg("out of memory"),
       errdetail("Failed while reallocation block %lu bytes in shared memory.",
       (unsigned long) size),
-      errhint("Increase SHMEMMSGSZ and recompile package.")));
+      errhint("Increase orafce.shared_memory_size.")));
   }
 
   return (result);
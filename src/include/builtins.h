@@ -56,6 +56,7 @@ extern PGDLLEXPORT Datum dbms_alert_set_defaults(PG_FUNCTION_ARGS);
 extern PGDLLEXPORT Datum dbms_alert_signal(PG_FUNCTION_ARGS);
 extern PGDLLEXPORT Datum dbms_alert_waitany(PG_FUNCTION_ARGS);
 extern PGDLLEXPORT Datum dbms_alert_waitone(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT Datum dbms_alert_waitany_all(PG_FUNCTION_ARGS);
 extern PGDLLEXPORT Datum dbms_alert_defered_signal(PG_FUNCTION_ARGS);
 
 /* from assert.c */
@@ -154,6 +155,19 @@ extern PGDLLEXPORT Datum dbms_pipe_pack_message_record(PG_FUNCTION_ARGS);
 extern PGDLLEXPORT Datum dbms_pipe_unpack_message_record(PG_FUNCTION_ARGS);
 extern PGDLLEXPORT Datum dbms_pipe_pack_message_integer(PG_FUNCTION_ARGS);
 extern PGDLLEXPORT Datum dbms_pipe_pack_message_bigint(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT Datum dbms_pipe_send_messages(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT Datum dbms_pipe_receive_messages(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT Datum dbms_pipe_pipe_stats(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT Datum dbms_pipe_receive_any(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT Datum dbms_pipe_create_fanout_pipe(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT Datum dbms_pipe_subscribe(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT Datum dbms_pipe_unsubscribe(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT Datum dbms_pipe_set_spill_threshold(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT Datum dbms_pipe_pack_message_any(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT Datum dbms_pipe_unpack_message_any(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT Datum dbms_pipe_set_pipe_ttl(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT Datum dbms_pipe_set_message_ttl(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT Datum dbms_pipe_received_bytes_copied(PG_FUNCTION_ARGS);
 
 /* from plunit.c */
 extern PGDLLEXPORT Datum plunit_assert_true(PG_FUNCTION_ARGS);
@@ -1,43 +1,134 @@
 #ifndef __PIPE__
 #define __PIPE__
 
+#if PG_VERSION_NUM >= 120000
+#include "storage/condition_variable.h"
+#endif
+
+/*
+ * The local pack buffer starts small and grows up to the size set by
+ * orafce.pipe_max_message_size. A buffer bigger than LOCALMSGSZ is
+ * released after the message is sent.
+ */
 #define LOCALMSGSZ    (8*1024)
-#define SHMEMMSGSZ    (30*1024)
-#define MAX_PIPES     30
-#define MAX_EVENTS    30
-#define MAX_LOCKS     256
 
+extern int orafce_pipe_max_message_size;
+
+#define MAXMSGSZ      ((Size) orafce_pipe_max_message_size * 1024)
+
+/* message bigger than orafce.pipe_compression_threshold kB is compressed */
+extern int orafce_pipe_compression_threshold;
+
+/*
+ * Size of shared memory and limits of shared objects are set by
+ * orafce.shared_memory_size, orafce.max_pipes, orafce.max_events
+ * and orafce.max_locks.
+ */
+extern int orafce_shared_memory_size;
+extern int orafce_max_pipes;
+extern int orafce_max_events;
+extern int orafce_max_locks;
+
+#define SHMEMMSGSZ    ((Size) orafce_shared_memory_size * 1024)
+#define MAX_PIPES     orafce_max_pipes
+#define MAX_EVENTS    orafce_max_events
+#define MAX_LOCKS     orafce_max_locks
+
+/*
+ * When orafce.alert_notify_prefix is set, signaled alerts are published by
+ * NOTIFY and registered sessions LISTEN on channel prefix || alert name.
+ */
+extern char *orafce_alert_notify_prefix;
+
+/*
+ * Waiters sleep on condition variable when it is available (it needs
+ * timed sleep of PostgreSQL 12), elsewhere they poll shared memory.
+ */
+#if PG_VERSION_NUM >= 120000
+#define ORA_WAIT_CV
+typedef ConditionVariable ora_cv;
+#else
+typedef int ora_cv;
+#endif
+
+/*
+ * Sleeping sessions report wait event of class Extension (PostgreSQL 10
+ * and newer), so they are not shown as active in pg_stat_activity. Since
+ * PostgreSQL 17 every event has its own name.
+ */
+#if PG_VERSION_NUM >= 100000
+#define ORA_WAIT_EVENTS
+#endif
+
+typedef enum {
+  ORA_WAIT_PIPE_RECEIVE,    /* OrafcePipeReceive */
+  ORA_WAIT_PIPE_SEND,       /* OrafcePipeSend */
+  ORA_WAIT_ALERT,           /* OrafceAlertWait */
+  ORA_WAIT_SHMEM,           /* OrafceSharedMemory */
+  ORA_WAIT_EVENTS_COUNT
+} ora_wait_event;
+
+/*
+ * Signaled message is stored once, in one block together with its text.
+ * Receivers are marked in bitmap indexed by slot of their session lock,
+ * the message is released when the last of them reads it.
+ */
 typedef struct _message_item {
-  char                 *message;
-  float8                timestamp;
-  struct _message_item *next_message;
+  char                 *message;      /* behind the bitmap, or NULL */
+  struct _message_item *next_message; /* messages of the same event */
   struct _message_item *prev_message;
-  unsigned char         message_id;
-  int                  *receivers;    /* copy of array all registered receivers */
-  int                   receivers_number;
+  struct _message_item *queue_next;   /* all messages in order of signals */
+  struct _message_item *queue_prev;
+  int                   message_id;
+  int                   refs;         /* receivers, who haven't read it */
+  bits8                 receivers[1]; /* flexible array member */
 } message_item;
 
-typedef struct _message_echo {
-  struct _message_item *message;
-  unsigned char         message_id;
-  struct _message_echo *next_echo;
-} message_echo;
-
 typedef struct {
   char                 *event_name;
-  unsigned char         max_receivers;
+  int                   max_receivers;
   int                  *receivers;
   int                   receivers_number;
   struct _message_item *messages;
+  uint32                hashval;
+  int                   hash_next;  /* next event in bucket or in free list */
 } alert_event;
 
 typedef struct {
   unsigned int  sid;
-  message_echo *echo;
+  int           pending;    /* messages for session */
+  ora_cv        cv;         /* signaled when message for session is created */
+  int           hash_next;  /* next lock in bucket or in free list */
 } alert_lock;
 
-bool ora_lock_shmem(size_t size, int max_pipes, int max_events, int max_locks,
-  bool reset);
+/*
+ * Events are indexed by hash of name, session locks by session id.
+ * Buckets and hash_next links are indexes to arrays of events and locks,
+ * unused entries are linked in free lists. Event buckets are followed by
+ * lock buckets.
+ */
+typedef struct {
+  message_item *first_message;  /* queue of all messages */
+  message_item *last_message;
+  int           nevent_buckets; /* power of 2 */
+  int           nlock_buckets;  /* power of 2 */
+  int           free_event;
+  int           free_lock;
+  int           buckets[1];     /* flexible array member */
+} alert_directory;
+
+#define NO_ALERT_ENTRY    -1
+
+Size ora_shmem_size(size_t size, int max_pipes, int max_events,
+  int max_locks);
+bool ora_attach_shmem(size_t size, int max_pipes, int max_events,
+  int max_locks);
+
+void ora_cv_init(ora_cv *cv);
+void ora_cv_broadcast(ora_cv *cv);
+void ora_cv_sleep(ora_cv *cv, float8 endtime, ora_wait_event event);
+void ora_sleep(ora_wait_event event);
+void ora_cv_cancel(void);
 
 #define ERRCODE_ORA_PACKAGES_LOCK_REQUEST_ERROR \
   MAKE_SQLSTATE('3', '0', '0',                  \
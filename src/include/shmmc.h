@@ -1,7 +1,11 @@
 #ifndef __SHMMC__
 #define __SHMMC__
 
-void ora_sinit(void *ptr, size_t size, bool create);
+#include "storage/lwlock.h"
+#include "pipe.h"
+
+void ora_sinit(void *ptr, size_t size, bool create, LWLockId lock,
+  ora_cv *freed_cv);
 void *ora_salloc(size_t size);
 void *ora_srealloc(void *ptr, size_t size);
 void ora_sfree(void *ptr);